@@ -0,0 +1,354 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "output.h"
+#include "source.h"
+#include "vm.h"
+
+// The scripts are shared out among a pool of threads, each with a VM of its own.
+// A VM keeps its interned strings from one script to the next, so a literal that every script uses
+// is only copied once per thread, but the globals are cleared in between, so every script starts fresh.
+//
+// What each script prints is kept until it has finished and then written to stdout
+// in the order the scripts were given, so the output is the same as running them one at a time.
+// Error messages still go straight to stderr as they happen.
+// After each script's output, a line on stderr says how it ended and how long it took,
+// and the batch ends with a summary.
+
+typedef struct {
+    char* path;
+    int exitCode; // what clox would have exited with for this script alone
+    double seconds;
+    char* output;
+    size_t outputLength;
+    size_t outputCapacity;
+    bool done;
+} Script;
+
+typedef struct {
+    Script* scripts;
+    int count;
+    int capacity;
+} ScriptList;
+
+typedef struct Batch Batch;
+
+// Every worker starts with a run of consecutive scripts that it works through from the front.
+// One that runs out takes the back half of another's run, so the threads stay busy to the end
+// however unevenly the scripts' running times are spread.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int next; // the scripts from next up to end are still to be run
+    int end;
+    Batch* batch;
+} Worker;
+
+struct Batch {
+    ScriptList scripts;
+    Worker* workers;
+    int workerCount;
+    bool traceExecution; // copied from the main thread's VM into each worker's
+    bool printCode;
+    bool printStats;
+    CodeFormat codeFormat;
+#ifdef PROFILE_OPCODES
+    Profile* profile; // the main thread's VM's, which each worker adds its own counts to when it's done
+#endif
+
+    pthread_mutex_t doneLock;
+    pthread_cond_t scriptDone;
+};
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static char* copyPath(const char* path) {
+    size_t length = strlen(path);
+    char* copy = (char*)malloc(length + 1);
+    if (copy == NULL) exit(1);
+    memcpy(copy, path, length + 1);
+    return copy;
+}
+
+static void addScript(ScriptList* list, char* path) {
+    if (list->capacity < list->count + 1) {
+        list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        list->scripts = (Script*)realloc(list->scripts, sizeof(Script) * list->capacity);
+        if (list->scripts == NULL) exit(1);
+    }
+    Script* script = &list->scripts[list->count++];
+    memset(script, 0, sizeof(Script));
+    script->path = path;
+}
+
+static int comparePaths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static bool isLoxFile(const char* name) {
+    size_t length = strlen(name);
+    return length > 4 && strcmp(name + length - 4, ".lox") == 0;
+}
+
+// Adds the .lox files in directory and its subdirectories, in the order of their names.
+static void addDirectory(ScriptList* list, const char* directory) {
+    DIR* dir = opendir(directory);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open directory \"%s\".\n", directory);
+        return;
+    }
+
+    char** entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        size_t length = strlen(directory) + strlen(entry->d_name) + 2;
+        char* path = (char*)malloc(length);
+        if (path == NULL) exit(1);
+        snprintf(path, length, "%s/%s", directory, entry->d_name);
+        if (count + 1 > capacity) {
+            capacity = capacity < 8 ? 8 : capacity * 2;
+            entries = (char**)realloc(entries, sizeof(char*) * capacity);
+            if (entries == NULL) exit(1);
+        }
+        entries[count++] = path;
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(char*), comparePaths);
+    for (int i = 0; i < count; i++) {
+        if (isDirectory(entries[i])) {
+            addDirectory(list, entries[i]);
+            free(entries[i]);
+        } else if (isLoxFile(entries[i])) {
+            addScript(list, entries[i]);
+        } else {
+            free(entries[i]);
+        }
+    }
+    free(entries);
+}
+
+static void captureOutput(const char* chars, size_t length, void* userData) {
+    Script* script = (Script*)userData;
+    if (script->outputCapacity < script->outputLength + length) {
+        size_t capacity = script->outputCapacity < 256 ? 256 : script->outputCapacity;
+        while (capacity < script->outputLength + length) capacity *= 2;
+        script->output = (char*)realloc(script->output, capacity);
+        if (script->output == NULL) exit(1);
+        script->outputCapacity = capacity;
+    }
+    memcpy(script->output + script->outputLength, chars, length);
+    script->outputLength += length;
+}
+
+static void runScript(Batch* batch, Script* script) {
+    double start = now();
+    Source source;
+    if (!readSource(script->path, &source)) {
+        script->exitCode = 74;
+    } else {
+        setOutputSink(captureOutput, script);
+        InterpretResult result = interpretSource(script->path, &source);
+        setOutputSink(NULL, NULL);
+        freeSource(&source);
+        resetGlobals();
+
+        if (result == INTERPRET_COMPILE_ERROR) script->exitCode = 65;
+        if (result == INTERPRET_RUNTIME_ERROR) script->exitCode = 70;
+    }
+    script->seconds = now() - start;
+
+    pthread_mutex_lock(&batch->doneLock);
+    script->done = true;
+    pthread_cond_signal(&batch->scriptDone);
+    pthread_mutex_unlock(&batch->doneLock);
+}
+
+// The next script for worker to run, or -1 once there are none left anywhere.
+// Scripts only ever move from one worker to another, never appear, so when every run is empty the batch is done.
+static int nextScript(Worker* worker) {
+    pthread_mutex_lock(&worker->lock);
+    int index = worker->next < worker->end ? worker->next++ : -1;
+    pthread_mutex_unlock(&worker->lock);
+    if (index != -1) return index;
+
+    Batch* batch = worker->batch;
+    int self = (int)(worker - batch->workers);
+    for (int i = 1; i < batch->workerCount; i++) {
+        Worker* victim = &batch->workers[(self + i) % batch->workerCount];
+        pthread_mutex_lock(&victim->lock);
+        int left = victim->end - victim->next;
+        if (left > 0) {
+            // Leave the victim the front half, which it's about to get to, and take the rest.
+            int middle = victim->next + left / 2;
+            int end = victim->end;
+            victim->end = middle;
+            pthread_mutex_unlock(&victim->lock);
+
+            pthread_mutex_lock(&worker->lock);
+            worker->next = middle + 1;
+            worker->end = end;
+            pthread_mutex_unlock(&worker->lock);
+            return middle;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return -1;
+}
+
+static void* work(void* argument) {
+    Worker* worker = (Worker*)argument;
+    Batch* batch = worker->batch;
+
+    VM* instance = (VM*)malloc(sizeof(VM));
+    if (instance == NULL) exit(1);
+    vmInit(instance);
+    instance->traceExecution = batch->traceExecution;
+    instance->printCode = batch->printCode;
+    instance->codeFormat = batch->codeFormat;
+#ifdef PROFILE_OPCODES
+    Profile profile;
+    if (batch->profile != NULL) {
+        initProfile(&profile, batch->profile->sampleInterval);
+        instance->profile = &profile;
+    }
+#endif
+
+    int index;
+    while ((index = nextScript(worker)) != -1) {
+        runScript(batch, &batch->scripts.scripts[index]);
+    }
+
+#ifdef PROFILE_OPCODES
+    if (batch->profile != NULL) {
+        pthread_mutex_lock(&batch->doneLock);
+        mergeProfile(batch->profile, &profile);
+        pthread_mutex_unlock(&batch->doneLock);
+        freeProfile(&profile);
+    }
+#endif
+
+    // Each worker's VM has stats of its own, printed whole, one worker at a time.
+    if (batch->printStats) {
+        VMStats stats;
+        vmGetStats(instance, &stats);
+        flushOutput();
+        pthread_mutex_lock(&batch->doneLock);
+        fflush(stdout);
+        fprintf(stderr, "worker %d: ", (int)(worker - batch->workers));
+        printStats(&stats, stderr);
+        pthread_mutex_unlock(&batch->doneLock);
+    }
+
+    vmFree(instance);
+    free(instance);
+    return NULL;
+}
+
+static const char* describe(int exitCode) {
+    switch (exitCode) {
+        case 0:  return "ok";
+        case 65: return "compile error";
+        case 70: return "runtime error";
+        default: return "unreadable";
+    }
+}
+
+int runBatch(const char* const* paths, int pathCount, int jobs) {
+    Batch batch;
+    batch.scripts.scripts = NULL;
+    batch.scripts.count = 0;
+    batch.scripts.capacity = 0;
+    for (int i = 0; i < pathCount; i++) {
+        if (isDirectory(paths[i])) {
+            addDirectory(&batch.scripts, paths[i]);
+        } else {
+            addScript(&batch.scripts, copyPath(paths[i]));
+        }
+    }
+    int count = batch.scripts.count;
+    if (count == 0) {
+        fprintf(stderr, "No scripts to run.\n");
+        return 66;
+    }
+
+    if (jobs <= 0) jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs < 1) jobs = 1;
+    if (jobs > count) jobs = count;
+
+    batch.traceExecution = vm->traceExecution;
+    batch.printCode = vm->printCode;
+    batch.printStats = vm->printStats;
+    batch.codeFormat = vm->codeFormat;
+#ifdef PROFILE_OPCODES
+    batch.profile = vm->profile;
+#endif
+    batch.workerCount = jobs;
+    batch.workers = (Worker*)malloc(sizeof(Worker) * jobs);
+    if (batch.workers == NULL) exit(1);
+    pthread_mutex_init(&batch.doneLock, NULL);
+    pthread_cond_init(&batch.scriptDone, NULL);
+
+    double start = now();
+    for (int i = 0; i < jobs; i++) {
+        Worker* worker = &batch.workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->next = (int)((long)count * i / jobs);
+        worker->end = (int)((long)count * (i + 1) / jobs);
+        worker->batch = &batch;
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_create(&batch.workers[i].thread, NULL, work, &batch.workers[i]);
+    }
+
+    int exitCode = 0;
+    int outcomes[4] = {0}; // ok, compile errors, runtime errors, unreadable
+    double busy = 0;
+    for (int i = 0; i < count; i++) {
+        Script* script = &batch.scripts.scripts[i];
+        pthread_mutex_lock(&batch.doneLock);
+        while (!script->done) pthread_cond_wait(&batch.scriptDone, &batch.doneLock);
+        pthread_mutex_unlock(&batch.doneLock);
+
+        // A script that printed nothing never got a buffer.
+        if (script->outputLength > 0) fwrite(script->output, 1, script->outputLength, stdout);
+        fflush(stdout);
+        fprintf(stderr, "%-14s %9.3f ms  %s\n", describe(script->exitCode), script->seconds * 1e3, script->path);
+
+        outcomes[script->exitCode == 0 ? 0 : script->exitCode == 65 ? 1 : script->exitCode == 70 ? 2 : 3]++;
+        if (exitCode == 0) exitCode = script->exitCode;
+        busy += script->seconds;
+        free(script->output);
+        free(script->path);
+    }
+
+    // Every worker has to be done before any lock goes, since the last ones may still be looking for work to steal.
+    for (int i = 0; i < jobs; i++) {
+        pthread_join(batch.workers[i].thread, NULL);
+    }
+    for (int i = 0; i < jobs; i++) {
+        pthread_mutex_destroy(&batch.workers[i].lock);
+    }
+    fprintf(stderr, "%d scripts on %d threads in %.3f s (%.3f s of work): "
+                    "%d ok, %d compile errors, %d runtime errors, %d unreadable\n",
+            count, jobs, now() - start, busy, outcomes[0], outcomes[1], outcomes[2], outcomes[3]);
+
+    pthread_cond_destroy(&batch.scriptDone);
+    pthread_mutex_destroy(&batch.doneLock);
+    free(batch.workers);
+    free(batch.scripts.scripts);
+    return exitCode;
+}
@@ -0,0 +1,9 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+// Runs many scripts at once, for jobs that would otherwise start clox once per script. See batch.c.
+// Each path is a script or a directory of them; jobs is the number of threads, or 0 for one per core.
+// Returns the exit code clox should finish with.
+int runBatch(const char* const* paths, int pathCount, int jobs);
+
+#endif
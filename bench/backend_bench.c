@@ -0,0 +1,153 @@
+// The stack VM against the register VM (see registers.h), on the workloads in lox/.
+// Each workload is compiled once to each instruction set and the chunk run over and over,
+// so what's timed is run() or runRegisters() alone, without the compiler.
+// Nothing jumps, so every instruction in a chunk runs exactly once per run,
+// and its count of instructions is also the number of dispatches a run takes.
+//
+// Usage: backend_bench [--seconds s] [workload...]
+// where s is how long each workload runs for in each instruction set, 1 by default.
+// A run is a few microseconds, so each is timed by itself and the fastest of them reported,
+// which is the one the least got in the way of.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "output.h"
+#include "vm.h"
+
+static const char* workloads[] = {"arithmetic", "globals", "strings"};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static char* readWorkload(const char* name) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.lox", CLOX_BENCH_DIR, name);
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        exit(74);
+    }
+    fseek(in, 0L, SEEK_END);
+    size_t size = (size_t)ftell(in);
+    rewind(in);
+    char* source = (char*)malloc(size + 1);
+    size_t length = fread(source, 1, size, in);
+    source[length] = '\0';
+    fclose(in);
+    return source;
+}
+
+static void discard(const char* chars, size_t length, void* userData) {
+    (void)chars;
+    (void)length;
+    (void)userData;
+}
+
+static int countInstructions(const Chunk* chunk) {
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])) count++;
+    return count;
+}
+
+#define ROUNDS 10
+
+typedef struct {
+    int bytes;
+    int instructions;
+    int registers;
+    bool fellBack; // the register code was too deep, so the chunk stayed in FORMAT_STACK
+    double best;   // the fastest a run went, in nanoseconds
+} Result;
+
+// Compiles source to the given instruction set and runs it over and over for the given number of seconds,
+// keeping the time of the fastest run in result.
+// The chunk's constants are only roots while it runs, but nothing between runs allocates an object,
+// so the collector only ever runs while they're roots.
+static void measure(const char* source, CodeFormat format, double seconds, Result* result) {
+    vm->codeFormat = format;
+    Chunk chunk;
+    initChunk(&chunk, &vm->arena);
+    if (!compile(source, &chunk)) exit(65);
+    result->bytes = chunk.count;
+    result->instructions = countInstructions(&chunk);
+    result->registers = chunk.registerCount;
+    result->fellBack = format == FORMAT_REGISTER && chunk.format != FORMAT_REGISTER;
+
+    resetGlobals();
+    if (interpretChunk(&chunk) != INTERPRET_OK) exit(70);
+    double end = benchNow() + seconds;
+    double now;
+    do {
+        resetGlobals();
+        double start = benchNow();
+        interpretChunk(&chunk);
+        now = benchNow();
+        if ((now - start) * 1e9 < result->best) result->best = (now - start) * 1e9;
+    } while (now < end);
+
+    freeChunk(&chunk);
+    freeArena(&vm->arena);
+}
+
+static void printResult(const char* name, const char* format, const Result* result) {
+    printf("%-12s %-10s %8d %13d %10d %12.0f", name, format, result->bytes, result->instructions,
+           result->registers, result->best);
+}
+
+// The two instruction sets take turns, a round at a time, so that whatever else the machine is doing
+// slows them both down alike.
+static void compare(const char* name, const char* source, double seconds) {
+    Result stack = {0, 0, 0, false, 1e300};
+    Result registers = {0, 0, 0, false, 1e300};
+    for (int round = 0; round < ROUNDS; round++) {
+        measure(source, FORMAT_STACK, seconds / ROUNDS, &stack);
+        measure(source, FORMAT_REGISTER, seconds / ROUNDS, &registers);
+    }
+    printResult(name, "stack", &stack);
+    printf("\n");
+    printResult(name, "register", &registers);
+    printf("   %.2fx the stack's speed%s\n", stack.best / registers.best,
+           registers.fellBack ? " (too deep for registers)" : "");
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: backend_bench [--seconds s] [workload...]\n");
+    exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+    double seconds = 1.0;
+    const char* chosen[WORKLOAD_COUNT];
+    int chosenCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0) {
+            char* end;
+            if (i + 1 == argc) usage();
+            seconds = strtod(argv[++i], &end);
+            if (*end != '\0' || seconds < 0) usage();
+        } else {
+            int found = -1;
+            for (int w = 0; w < (int)WORKLOAD_COUNT; w++) {
+                if (strcmp(argv[i], workloads[w]) == 0) found = w;
+            }
+            if (found == -1 || chosenCount == (int)WORKLOAD_COUNT) usage();
+            chosen[chosenCount++] = workloads[found];
+        }
+    }
+    if (chosenCount == 0) {
+        for (int w = 0; w < (int)WORKLOAD_COUNT; w++) chosen[chosenCount++] = workloads[w];
+    }
+
+    initVM();
+    setOutputSink(discard, NULL);
+    printf("%-12s %-10s %8s %13s %10s %12s\n", "workload", "format", "bytes", "instructions", "registers", "best ns/run");
+    for (int i = 0; i < chosenCount; i++) {
+        char* source = readWorkload(chosen[i]);
+        compare(chosen[i], source, seconds);
+        free(source);
+    }
+    freeVM();
+    return 0;
+}
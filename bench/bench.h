@@ -0,0 +1,33 @@
+#ifndef clox_bench_h
+#define clox_bench_h
+
+// Helpers shared by the benchmark programs in this directory.
+// Each one includes this header exactly once, from its main file.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "vm.h"
+
+// Results are folded into this so the compiler can't throw the measured loops away.
+static volatile double benchSink;
+
+static inline double benchNow() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// The benchmarks keep strings in C arrays, where the collector can't see them,
+// so they call this right after initVM() to keep it from ever running.
+static inline void benchDisableGC() {
+    vm->nextGC = SIZE_MAX;
+    vm->nurserySize = SIZE_MAX;
+}
+
+static inline void benchReport(const char* name, double seconds, long operations) {
+    printf("%-28s %8.2f ns/op\n", name, seconds * 1e9 / (double)operations);
+}
+
+#endif
@@ -0,0 +1,152 @@
+// Benchmarks for the two string hashes in hash.h: FNV-1a, a byte at a time, and hashWords(), 16 bytes at a time.
+// - Speed over strings shaped like what the VM hashes: identifiers and short literals from the compiler,
+//   and long strings from concatenation and flattened ropes.
+// - Quality, as what matters to the tables: full 32-bit collisions, and probe lengths when the hashes
+//   key a table built with the configured backend.
+// It finishes with the probe statistics of vm->strings itself, hashed with whichever function
+// the build picked (CLOX_WORD_HASH).
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define KEY_COUNT (1 << 16)
+#define OPERATIONS (1 << 24)
+
+typedef uint32_t (*HashFn)(const char* key, int length);
+
+typedef struct {
+    const char* name;
+    HashFn hash;
+} HashFunction;
+
+static const HashFunction functions[] = {
+    {"fnv1a", hashFnv1a},
+    {"words", hashWords},
+};
+
+// Identifiers as a program would have them: short words, and names that differ only in a counter.
+static char* identifiers[KEY_COUNT];
+static int identifierLengths[KEY_COUNT];
+
+static void makeIdentifiers() {
+    static const char* stems[] = {"i", "x", "count", "total", "name", "itemIndex", "temp_", "userAccount"};
+    int stemCount = (int)(sizeof(stems) / sizeof(stems[0]));
+    for (int i = 0; i < KEY_COUNT; i++) {
+        char name[32];
+        int length = snprintf(name, sizeof(name), "%s%d", stems[i % stemCount], i / stemCount);
+        identifiers[i] = malloc(length + 1);
+        memcpy(identifiers[i], name, length + 1);
+        identifierLengths[i] = length;
+    }
+}
+
+static void benchIdentifiers(const HashFunction* function) {
+    char name[64];
+    uint32_t sum = 0;
+    double start = benchNow();
+    for (int i = 0; i < OPERATIONS; i++) {
+        int key = i & (KEY_COUNT - 1);
+        sum += function->hash(identifiers[key], identifierLengths[key]);
+    }
+    snprintf(name, sizeof(name), "%s identifiers", function->name);
+    benchReport(name, benchNow() - start, OPERATIONS);
+    benchSink = sum;
+}
+
+static void benchLong(const HashFunction* function, const char* text, int length) {
+    char name[64];
+    long operations = (256L << 20) / length; // 256 MiB per size
+    uint32_t sum = 0;
+    double start = benchNow();
+    for (long i = 0; i < operations; i++) {
+        sum += function->hash(text, length);
+    }
+    double seconds = benchNow() - start;
+    snprintf(name, sizeof(name), "%s %d bytes", function->name, length);
+    benchReport(name, seconds, operations);
+    printf("%-28s %8.2f GB/s\n", "", (double)length * operations / seconds / 1e9);
+    benchSink = sum;
+}
+
+static int compareHashes(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void reportStats(const char* name, Table* table) {
+    TableStats stats;
+    tableGetStats(table, &stats);
+    printf("%-28s %d keys in %d buckets, %.1f%% displaced, mean probe %.3f, max %d\n",
+           name, stats.count, stats.capacity, 100.0 * stats.displaced / stats.count,
+           stats.meanProbe, stats.maxProbe);
+}
+
+// The table only looks at key->hash and compares keys by pointer,
+// so stand-in strings with the hash under test fill it exactly as interned ones would.
+static void benchDistribution(const HashFunction* function) {
+    static uint32_t hashes[KEY_COUNT];
+    static ObjString* keys[KEY_COUNT];
+    for (int i = 0; i < KEY_COUNT; i++) {
+        hashes[i] = function->hash(identifiers[i], identifierLengths[i]);
+        keys[i] = malloc(sizeof(ObjString) + identifierLengths[i] + 1);
+        keys[i]->length = identifierLengths[i];
+        keys[i]->hash = hashes[i];
+        memcpy(keys[i]->chars, identifiers[i], identifierLengths[i] + 1);
+    }
+
+    qsort(hashes, KEY_COUNT, sizeof(uint32_t), compareHashes);
+    int collisions = 0;
+    for (int i = 1; i < KEY_COUNT; i++) {
+        if (hashes[i] == hashes[i - 1]) collisions++;
+    }
+
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < KEY_COUNT; i++) {
+        tableSet(&table, keys[i], NIL_VAL);
+    }
+    printf("%-28s %d full-hash collisions\n", function->name, collisions);
+    reportStats("", &table);
+    freeTable(&table);
+
+    for (int i = 0; i < KEY_COUNT; i++) free(keys[i]);
+}
+
+int main() {
+    initVM();
+    benchDisableGC();
+    makeIdentifiers();
+
+    int functionCount = (int)(sizeof(functions) / sizeof(functions[0]));
+    for (int i = 0; i < functionCount; i++) {
+        benchIdentifiers(&functions[i]);
+    }
+
+    static const int lengths[] = {64, 4096, 1 << 20};
+    char* text = malloc(1 << 20);
+    for (int i = 0; i < (1 << 20); i++) text[i] = (char)('a' + i % 26);
+    for (int i = 0; i < functionCount; i++) {
+        for (int j = 0; j < 3; j++) benchLong(&functions[i], text, lengths[j]);
+    }
+    free(text);
+
+    for (int i = 0; i < functionCount; i++) {
+        benchDistribution(&functions[i]);
+    }
+
+    for (int i = 0; i < KEY_COUNT; i++) {
+        copyString(identifiers[i], identifierLengths[i]);
+    }
+    reportStats("vm->strings", &vm->strings);
+
+    freeVM();
+    return 0;
+}
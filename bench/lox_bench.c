@@ -0,0 +1,279 @@
+// The benchmark suite: whole Lox workloads, timed end to end, for tracking the interpreter from one commit to the next.
+// - arithmetic, globals and strings are the scripts in lox/, each compiled and run over and over by one VM.
+// - compile is a generated script of a few megabytes, compiled over and over but never run.
+// Each workload runs in a process of its own, so that its peak RSS is its own.
+// The results are JSON lines, one object per workload, with the fields
+//   workload, label, ops, seconds, ops_per_sec, instructions, instructions_per_op,
+//   allocations, allocations_per_op, bytes_allocated, peak_rss_kb
+// where an op is one run of the workload, instructions counts the instructions retired in user mode
+// (null where the hardware counter isn't available), and allocations and bytes_allocated are the VM's own,
+// from its pools, large blocks and arena.
+//
+// Usage: lox_bench [--label text] [--seconds s] [workload...]
+// The label goes into every record, for telling the runs apart, as by the commit they were built from.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bench.h"
+#include "compiler.h"
+#include "output.h"
+#include "vm.h"
+
+#define COMPILE_STATEMENTS 100000
+
+typedef enum {
+    WORKLOAD_RUN,
+    WORKLOAD_COMPILE,
+} WorkloadKind;
+
+typedef struct {
+    const char* name;
+    const char* file; // in lox/, or NULL for a generated source
+    WorkloadKind kind;
+} Workload;
+
+static const Workload workloads[] = {
+    {"arithmetic", "arithmetic.lox", WORKLOAD_RUN},
+    {"globals", "globals.lox", WORKLOAD_RUN},
+    {"strings", "strings.lox", WORKLOAD_RUN},
+    {"compile", NULL, WORKLOAD_COMPILE},
+};
+
+#define WORKLOAD_COUNT (sizeof(workloads) / sizeof(workloads[0]))
+
+static char* readWorkload(const char* file) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", CLOX_BENCH_DIR, file);
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        fprintf(stderr, "Could not open %s.\n", path);
+        exit(74);
+    }
+    fseek(in, 0L, SEEK_END);
+    size_t size = (size_t)ftell(in);
+    rewind(in);
+    char* source = (char*)malloc(size + 1);
+    size_t length = fread(source, 1, size, in);
+    source[length] = '\0';
+    fclose(in);
+    return source;
+}
+
+// Declarations of every kind the compiler handles, with plenty of globals and constants to intern.
+static char* makeCompileSource() {
+    size_t capacity = (size_t)COMPILE_STATEMENTS * 64;
+    char* source = (char*)malloc(capacity);
+    size_t length = 0;
+    for (int i = 0; i < COMPILE_STATEMENTS; i++) {
+        int a = i % 500;
+        int b = (i * 7) % 500;
+        switch (i % 4) {
+            case 0:
+                length += snprintf(source + length, capacity - length, "var v%d = %d.5 * v%d;\n", a, i, b);
+                break;
+            case 1:
+                length += snprintf(source + length, capacity - length, "v%d = (v%d + 1) / -v%d;\n", a, b, a);
+                break;
+            case 2:
+                length += snprintf(source + length, capacity - length, "print \"s%d\" + v%d;\n", i, b);
+                break;
+            default:
+                length += snprintf(source + length, capacity - length, "print !(v%d < v%d) == nil;\n", a, b);
+                break;
+        }
+    }
+    return source;
+}
+
+static void discard(const char* chars, size_t length, void* userData) {
+    (void)chars;
+    (void)length;
+    (void)userData;
+}
+
+#ifdef __linux__
+static int openInstructionCounter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void startInstructionCounter(int counter) {
+    if (counter < 0) return;
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static bool stopInstructionCounter(int counter, uint64_t* instructions) {
+    if (counter < 0) return false;
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    return read(counter, instructions, sizeof(*instructions)) == (ssize_t)sizeof(*instructions);
+}
+#else
+static int openInstructionCounter() {
+    return -1;
+}
+
+static void startInstructionCounter(int counter) {
+    (void)counter;
+}
+
+static bool stopInstructionCounter(int counter, uint64_t* instructions) {
+    (void)counter;
+    (void)instructions;
+    return false;
+}
+#endif
+
+static void countAllocations(size_t* allocations, size_t* bytes) {
+    MemoryStats stats;
+    getMemoryStats(&stats);
+    *allocations = stats.arena.allocations + stats.large.allocations;
+    *bytes = stats.arena.bytes + stats.large.bytes;
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        *allocations += stats.pools[i].allocations;
+        *bytes += stats.pools[i].bytes;
+    }
+}
+
+static void runOnce(const Workload* workload, const char* source) {
+    if (workload->kind == WORKLOAD_RUN) {
+        resetGlobals();
+        interpret(source);
+        return;
+    }
+    Chunk chunk;
+    initChunk(&chunk, &vm->arena);
+    if (!compile(source, &chunk)) exit(65);
+    freeChunk(&chunk);
+    freeArena(&vm->arena);
+}
+
+static void printJSONString(const char* text) {
+    putchar('"');
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if ((unsigned char)*c < 0x20) {
+            printf("\\u%04x", (unsigned char)*c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+// Runs the workload for about the given number of seconds, after a run to warm up, and prints its record.
+static void measure(const Workload* workload, const char* label, double seconds) {
+    char* source = workload->file != NULL ? readWorkload(workload->file) : makeCompileSource();
+    initVM();
+    setOutputSink(discard, NULL);
+    runOnce(workload, source);
+
+    int counter = openInstructionCounter();
+    size_t allocationsBefore, bytesBefore;
+    countAllocations(&allocationsBefore, &bytesBefore);
+    long ops = 0;
+    double start = benchNow();
+    double elapsed;
+    startInstructionCounter(counter);
+    do {
+        runOnce(workload, source);
+        ops++;
+        elapsed = benchNow() - start;
+    } while (elapsed < seconds);
+    uint64_t instructions;
+    bool counted = stopInstructionCounter(counter, &instructions);
+    size_t allocations, bytes;
+    countAllocations(&allocations, &bytes);
+    allocations -= allocationsBefore;
+    bytes -= bytesBefore;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    long peakKilobytes = usage.ru_maxrss / 1024;
+#else
+    long peakKilobytes = usage.ru_maxrss;
+#endif
+
+    printf("{\"workload\": \"%s\", \"label\": ", workload->name);
+    printJSONString(label);
+    printf(", \"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.2f, ", ops, elapsed, (double)ops / elapsed);
+    if (counted) {
+        printf("\"instructions\": %llu, \"instructions_per_op\": %.0f, ",
+               (unsigned long long)instructions, (double)instructions / (double)ops);
+    } else {
+        printf("\"instructions\": null, \"instructions_per_op\": null, ");
+    }
+    printf("\"allocations\": %zu, \"allocations_per_op\": %.1f, \"bytes_allocated\": %zu, \"peak_rss_kb\": %ld}\n",
+           allocations, (double)allocations / (double)ops, bytes, peakKilobytes);
+    fflush(stdout);
+
+    freeVM();
+    free(source);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: lox_bench [--label text] [--seconds s] [workload...]\n");
+    exit(64);
+}
+
+int main(int argc, const char* argv[]) {
+    const char* label = "";
+    double seconds = 1.0;
+    const Workload* chosen[WORKLOAD_COUNT];
+    int chosenCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--label") == 0) {
+            if (i + 1 == argc) usage();
+            label = argv[++i];
+        } else if (strcmp(argv[i], "--seconds") == 0) {
+            char* end;
+            if (i + 1 == argc) usage();
+            seconds = strtod(argv[++i], &end);
+            if (*end != '\0' || seconds < 0) usage();
+        } else {
+            int found = -1;
+            for (int w = 0; w < (int)WORKLOAD_COUNT; w++) {
+                if (strcmp(argv[i], workloads[w].name) == 0) found = w;
+            }
+            if (found == -1 || chosenCount == (int)WORKLOAD_COUNT) usage();
+            chosen[chosenCount++] = &workloads[found];
+        }
+    }
+    if (chosenCount == 0) {
+        for (int w = 0; w < (int)WORKLOAD_COUNT; w++) chosen[chosenCount++] = &workloads[w];
+    }
+
+    int failures = 0;
+    for (int i = 0; i < chosenCount; i++) {
+        pid_t child = fork();
+        if (child == 0) {
+            measure(chosen[i], label, seconds);
+            _exit(0);
+        }
+        int status;
+        if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "The %s workload failed.\n", chosen[i]->name);
+            failures++;
+        }
+    }
+    return failures == 0 ? 0 : 70;
+}
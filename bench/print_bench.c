@@ -0,0 +1,102 @@
+// Benchmarks for what print does with a number: formatting it, and getting the text out.
+// - formatNumber() against the snprintf("%g") it stands in for, over integers, short decimals
+//   and arbitrary fractions, which mostly take the fast path, and large numbers, which never do.
+// - A whole print, value and newline, into the VM's output buffer and a sink that throws it away,
+//   against the printf() per value and per newline that OP_PRINT used to make, writing to /dev/null.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bench.h"
+#include "output.h"
+#include "value.h"
+
+#define NUMBER_COUNT 4096
+#define OPERATIONS (1 << 22)
+
+typedef struct {
+    const char* name;
+    double numbers[NUMBER_COUNT];
+} NumberSet;
+
+static NumberSet sets[4];
+
+static void makeNumbers() {
+    sets[0].name = "integers";
+    sets[1].name = "decimals";
+    sets[2].name = "fractions";
+    sets[3].name = "large";
+    for (int i = 0; i < NUMBER_COUNT; i++) {
+        sets[0].numbers[i] = i * 37 - 50000;
+        sets[1].numbers[i] = (i * 37 - 50000) / 4.0;
+        sets[2].numbers[i] = (i + 1) / 7.0;
+        sets[3].numbers[i] = (i + 1) * 1e12 / 3.0;
+    }
+}
+
+static void benchFormat(const NumberSet* set, bool snprintfOnly) {
+    char name[64];
+    char buffer[NUMBER_BUFFER_SIZE];
+    long length = 0;
+    double start = benchNow();
+    for (int i = 0; i < OPERATIONS; i++) {
+        double number = set->numbers[i & (NUMBER_COUNT - 1)];
+        length += snprintfOnly ? snprintf(buffer, sizeof(buffer), "%g", number)
+                               : formatNumber(number, buffer);
+    }
+    snprintf(name, sizeof(name), "%s %s", snprintfOnly ? "snprintf" : "formatNumber", set->name);
+    benchReport(name, benchNow() - start, OPERATIONS);
+    benchSink = (double)length;
+}
+
+static size_t discarded = 0;
+
+static void discard(const char* chars, size_t length, void* userData) {
+    (void)chars;
+    (void)userData;
+    discarded += length;
+}
+
+static void benchPrint(const NumberSet* set) {
+    setOutputSink(discard, NULL);
+    double start = benchNow();
+    for (int i = 0; i < OPERATIONS; i++) {
+        printValue(NUMBER_VAL(set->numbers[i & (NUMBER_COUNT - 1)]));
+        endOutputLine();
+    }
+    flushOutput();
+    char name[64];
+    snprintf(name, sizeof(name), "buffered print %s", set->name);
+    benchReport(name, benchNow() - start, OPERATIONS);
+    setOutputSink(NULL, NULL);
+    benchSink = (double)discarded;
+
+    FILE* null = fopen("/dev/null", "w");
+    if (null == NULL) return;
+    start = benchNow();
+    for (int i = 0; i < OPERATIONS; i++) {
+        fprintf(null, "%g", set->numbers[i & (NUMBER_COUNT - 1)]);
+        fprintf(null, "\n");
+    }
+    fflush(null);
+    snprintf(name, sizeof(name), "printf %s", set->name);
+    benchReport(name, benchNow() - start, OPERATIONS);
+    fclose(null);
+}
+
+int main() {
+    initVM();
+    benchDisableGC();
+    makeNumbers();
+
+    for (int i = 0; i < 4; i++) {
+        benchFormat(&sets[i], true);
+        benchFormat(&sets[i], false);
+    }
+    for (int i = 0; i < 4; i++) {
+        benchPrint(&sets[i]);
+    }
+
+    freeVM();
+    return 0;
+}
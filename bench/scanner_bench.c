@@ -0,0 +1,111 @@
+// Scanner throughput, in MB of source and millions of tokens a second, over large generated inputs:
+// - data, the shape of a generated data script: short global names, numbers and string literals;
+// - code, the shape of something written by hand: indentation, comments, keywords and long names;
+// - prose, long string literals and comments, where the scanner is mostly looking for where they end.
+// Only the scanner runs, so this is the front end's floor before any compiling.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "scanner.h"
+
+#define INPUT_SIZE (32 * 1024 * 1024)
+#define ROUNDS 5
+
+typedef struct {
+    char* chars;
+    size_t length;
+    size_t capacity;
+} Input;
+
+static void appendText(Input* input, const char* text) {
+    size_t length = strlen(text);
+    if (input->length + length + 1 > input->capacity) return;
+    memcpy(input->chars + input->length, text, length + 1);
+    input->length += length;
+}
+
+static Input newInput() {
+    Input input;
+    input.capacity = INPUT_SIZE + 4096;
+    input.chars = malloc(input.capacity);
+    input.length = 0;
+    input.chars[0] = '\0';
+    return input;
+}
+
+static Input makeData() {
+    Input input = newInput();
+    char line[128];
+    for (int i = 0; input.length < INPUT_SIZE; i++) {
+        snprintf(line, sizeof(line), "var d%d = \"item %d\"; d%d = %d.%d * 3 + d%d;\n",
+                 i % 5000, i, i % 5000, i, i % 100, (i * 7) % 5000);
+        appendText(&input, line);
+    }
+    return input;
+}
+
+static Input makeCode() {
+    static const char* lines[] = {
+        "// Work out the running totals for this batch of accounts.\n",
+        "var accountBalance = openingBalance + totalDeposits - totalWithdrawals;\n",
+        "    var isOverdrawn = accountBalance < 0 and !hasOverdraftFacility;\n",
+        "    print isOverdrawn == false or accountBalance >= minimumBalance;\n",
+        "        interestRate = baseRate * 1.0125 + (premiumCustomer == true) * 0.25;\n",
+        "    var customerName = \"Account holder\" + separator + customerSurname;\n",
+        "\n",
+        "        // Nothing to do unless something changed.\n",
+        "    lastUpdated = nil;\n",
+    };
+    Input input = newInput();
+    for (int i = 0; input.length < INPUT_SIZE; i++) {
+        appendText(&input, lines[i % (int)(sizeof(lines) / sizeof(lines[0]))]);
+    }
+    return input;
+}
+
+static Input makeProse() {
+    Input input = newInput();
+    for (int i = 0; input.length < INPUT_SIZE; i++) {
+        appendText(&input, "// The quick brown fox jumps over the lazy dog, again and again and again.\n");
+        appendText(&input, "print \"It was the best of times, it was the worst of times, it was the age of wisdom.\";\n");
+    }
+    return input;
+}
+
+static void benchScan(const char* name, Input* input) {
+    long tokens = 0;
+    double best = 1e9;
+    for (int round = 0; round < ROUNDS; round++) {
+        long count = 0;
+        double start = benchNow();
+        initScanner(input->chars);
+        for (;;) {
+            Token token = scanToken();
+            count++;
+            if (token.type == TOKEN_EOF) break;
+        }
+        double seconds = benchNow() - start;
+        if (seconds < best) best = seconds;
+        tokens = count;
+    }
+    benchReport(name, best, tokens);
+    printf("%-28s %8.1f MB/s %8.1f Mtokens/s\n", "",
+           (double)input->length / best / 1e6, (double)tokens / best / 1e6);
+}
+
+int main() {
+    Input data = makeData();
+    Input code = makeCode();
+    Input prose = makeProse();
+
+    benchScan("data", &data);
+    benchScan("code", &code);
+    benchScan("prose", &prose);
+
+    free(data.chars);
+    free(code.chars);
+    free(prose.chars);
+    return 0;
+}
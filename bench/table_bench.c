@@ -0,0 +1,112 @@
+// Micro-benchmarks for Table, shaped like the two tables the VM leans on:
+// - vm->globals: a modest number of names, looked up and assigned over and over;
+// - vm->strings: every lexeme and concatenation result is looked up by its characters,
+//   with a mix of hits (the string was already interned) and misses followed by an insert.
+// Each workload runs at a few table sizes, from a handful of globals up to an intern table of a quarter million strings,
+// since probe behaviour changes as the table outgrows the caches.
+// It's built once per backend, as table_bench_linear and table_bench_swiss.
+
+#include <string.h>
+
+#include "bench.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#define MAX_KEYS   (1 << 18)
+#define OPERATIONS (1 << 22)
+
+static ObjString* keys[MAX_KEYS];
+static ObjString* absent[MAX_KEYS];
+
+static void makeKeys(ObjString** into, const char* prefix, int count) {
+    for (int i = 0; i < count; i++) {
+        char name[32];
+        int length = snprintf(name, sizeof(name), "%s%d", prefix, i);
+        into[i] = copyString(name, length);
+    }
+}
+
+static void benchGlobals(int size) {
+    char name[64];
+    Table table;
+    initTable(&table);
+
+    double start = benchNow();
+    for (int i = 0; i < size; i++) {
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+    snprintf(name, sizeof(name), "globals insert (%d)", size);
+    benchReport(name, benchNow() - start, size);
+
+    start = benchNow();
+    double sum = 0;
+    for (int i = 0; i < OPERATIONS; i++) {
+        Value value;
+        if (tableGet(&table, keys[i & (size - 1)], &value)) sum += AS_NUMBER(value);
+    }
+    snprintf(name, sizeof(name), "globals get (%d)", size);
+    benchReport(name, benchNow() - start, OPERATIONS);
+
+    start = benchNow();
+    for (int i = 0; i < OPERATIONS; i++) {
+        tableSet(&table, keys[i & (size - 1)], NUMBER_VAL(i));
+    }
+    snprintf(name, sizeof(name), "globals set (%d)", size);
+    benchReport(name, benchNow() - start, OPERATIONS);
+
+    benchSink = sum;
+    freeTable(&table);
+}
+
+static void benchInterning(int size) {
+    char name[64];
+    Table table;
+    initTable(&table);
+
+    // The strings exist already (they had to be hashed somewhere), but this table stands in for vm->strings.
+    double start = benchNow();
+    for (int i = 0; i < size; i++) {
+        if (tableFindString(&table, keys[i]->chars, keys[i]->length, keys[i]->hash) == NULL) {
+            tableSet(&table, keys[i], NIL_VAL);
+        }
+    }
+    snprintf(name, sizeof(name), "intern miss+insert (%d)", size);
+    benchReport(name, benchNow() - start, size);
+
+    start = benchNow();
+    int found = 0;
+    for (int i = 0; i < OPERATIONS; i++) {
+        ObjString* key = keys[i & (size - 1)];
+        if (tableFindString(&table, key->chars, key->length, key->hash) != NULL) found++;
+    }
+    snprintf(name, sizeof(name), "intern hit (%d)", size);
+    benchReport(name, benchNow() - start, OPERATIONS);
+
+    start = benchNow();
+    for (int i = 0; i < OPERATIONS; i++) {
+        ObjString* key = absent[i & (size - 1)];
+        if (tableFindString(&table, key->chars, key->length, key->hash) != NULL) found++;
+    }
+    snprintf(name, sizeof(name), "intern miss (%d)", size);
+    benchReport(name, benchNow() - start, OPERATIONS);
+
+    benchSink = found;
+    freeTable(&table);
+}
+
+int main() {
+    initVM();
+    benchDisableGC();
+    makeKeys(keys, "name", MAX_KEYS);
+    makeKeys(absent, "missing", MAX_KEYS);
+
+    for (int size = 64; size <= MAX_KEYS; size *= 16) {
+        benchGlobals(size);
+        benchInterning(size);
+    }
+
+    freeVM();
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Throughput of independent VMs running side by side, one per thread.
+// Each thread makes a VM of its own and interprets the same generated script over and over,
+// compiling it every time, with the output going to a sink that throws it away.
+// With nothing shared between the VMs, the scripts per second should grow with the thread count
+// until the cores run out. It goes up to one thread per core, or to the count given on the command line.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "output.h"
+#include "vm.h"
+
+#define STATEMENTS 2000
+#define RUNS_PER_THREAD 200
+#define MAX_THREADS 64
+
+static char* makeScript() {
+    size_t capacity = STATEMENTS * 64;
+    char* source = malloc(capacity);
+    size_t length = 0;
+    for (int i = 0; i < 64; i++) {
+        length += snprintf(source + length, capacity - length, "var v%d = %d;\n", i, i);
+    }
+    for (int i = 0; i < STATEMENTS; i++) {
+        int a = (i * 7) % 64;
+        int b = (i * 13 + 5) % 64;
+        if (i % 10 == 0) {
+            length += snprintf(source + length, capacity - length, "print \"v\" + \"%d\";\n", b);
+        } else {
+            length += snprintf(source + length, capacity - length,
+                               "v%d = v%d * 2 - (v%d + 1) / 3;\n", a, b, a);
+        }
+    }
+    return source;
+}
+
+static void discard(const char* chars, size_t length, void* userData) {
+    (void)chars;
+    *(size_t*)userData += length;
+}
+
+typedef struct {
+    pthread_t thread;
+    const char* source;
+    size_t printed;
+    bool failed;
+} Worker;
+
+static void* work(void* argument) {
+    Worker* worker = argument;
+    VM* instance = malloc(sizeof(VM));
+    vmInit(instance);
+    setOutputSink(discard, &worker->printed);
+    for (int i = 0; i < RUNS_PER_THREAD; i++) {
+        if (vmInterpret(instance, worker->source) != INTERPRET_OK) worker->failed = true;
+    }
+    vmFree(instance);
+    free(instance);
+    return NULL;
+}
+
+static double runThreads(const char* source, int threadCount) {
+    Worker workers[MAX_THREADS];
+    double start = benchNow();
+    for (int i = 0; i < threadCount; i++) {
+        workers[i].source = source;
+        workers[i].printed = 0;
+        workers[i].failed = false;
+        pthread_create(&workers[i].thread, NULL, work, &workers[i]);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].failed) fprintf(stderr, "thread %d: the script failed\n", i);
+    }
+    double seconds = benchNow() - start;
+    for (int i = 1; i < threadCount; i++) {
+        if (workers[i].printed != workers[0].printed) fprintf(stderr, "thread %d printed something else\n", i);
+    }
+    return seconds;
+}
+
+static double report(const char* source, int threadCount, double single) {
+    char name[32];
+    double seconds = runThreads(source, threadCount);
+    double perSecond = threadCount * RUNS_PER_THREAD / seconds;
+    snprintf(name, sizeof(name), "%d thread%s", threadCount, threadCount == 1 ? "" : "s");
+    benchReport(name, seconds, (long)threadCount * RUNS_PER_THREAD);
+    printf("%-28s %8.1f scripts/s, %.2fx one thread\n", "", perSecond, single > 0 ? perSecond / single : 1.0);
+    return perSecond;
+}
+
+int main(int argc, const char* argv[]) {
+    char* source = makeScript();
+    long maxThreads = argc > 1 ? strtol(argv[1], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxThreads < 1) maxThreads = 1;
+    if (maxThreads > MAX_THREADS) maxThreads = MAX_THREADS;
+
+    double single = report(source, 1, 0);
+    int threadCount = 2;
+    for (; threadCount <= maxThreads; threadCount *= 2) {
+        report(source, threadCount, single);
+    }
+    if (threadCount / 2 != maxThreads) report(source, (int)maxThreads, single);
+
+    free(source);
+    return 0;
+}
@@ -0,0 +1,107 @@
+// Micro-benchmarks for the Value representation.
+//
+// bench/CMakeLists.txt builds this file twice, as value_bench_tagged and value_bench_nanbox,
+// so running both compares the tagged union against NaN boxing on the same workloads:
+// the stack-like sequential traffic of a ValueArray, valuesEqual(), and globals-style table lookups.
+
+#include "bench.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "vm.h"
+
+#define VALUE_COUNT 1000000
+#define TABLE_KEYS  1024
+#define ROUNDS      50
+
+static Value mixedValue(int i) {
+    switch (i % 4) {
+        case 0:  return NUMBER_VAL(i);
+        case 1:  return BOOL_VAL(i & 2);
+        case 2:  return NIL_VAL;
+        default: return NUMBER_VAL(i * 0.5);
+    }
+}
+
+static void benchArrayScan(ValueArray* array) {
+    double start = benchNow();
+    double sum = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < array->count; i++) {
+            Value value = array->values[i];
+            if (IS_NUMBER(value)) {
+                sum += AS_NUMBER(value);
+            } else if (IS_BOOL(value) && AS_BOOL(value)) {
+                sum += 1;
+            }
+        }
+    }
+    benchReport("array scan", benchNow() - start, (long)array->count * ROUNDS);
+    benchSink = sum;
+}
+
+static void benchEquality(ValueArray* array) {
+    double start = benchNow();
+    int equal = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 1; i < array->count; i++) {
+            if (valuesEqual(array->values[i - 1], array->values[i])) equal++;
+        }
+    }
+    benchReport("valuesEqual", benchNow() - start, (long)(array->count - 1) * ROUNDS);
+    benchSink = equal;
+}
+
+static void benchTable() {
+    ObjString* keys[TABLE_KEYS];
+    for (int i = 0; i < TABLE_KEYS; i++) {
+        char name[16];
+        int length = snprintf(name, sizeof(name), "global%d", i);
+        keys[i] = copyString(name, length);
+    }
+
+    Table table;
+    initTable(&table);
+    for (int i = 0; i < TABLE_KEYS; i++) {
+        tableSet(&table, keys[i], NUMBER_VAL(i));
+    }
+
+    double start = benchNow();
+    double sum = 0;
+    for (int round = 0; round < ROUNDS * 100; round++) {
+        for (int i = 0; i < TABLE_KEYS; i++) {
+            Value value;
+            if (tableGet(&table, keys[i], &value)) sum += AS_NUMBER(value);
+        }
+    }
+    benchReport("tableGet", benchNow() - start, (long)TABLE_KEYS * ROUNDS * 100);
+    benchSink = sum;
+
+    freeTable(&table);
+}
+
+int main() {
+    initVM();
+    benchDisableGC();
+
+#ifdef NAN_BOXING
+    printf("layout: NaN boxing\n");
+#else
+    printf("layout: tagged union\n");
+#endif
+    printf("sizeof(Value) = %zu, sizeof(Entry) = %zu\n", sizeof(Value), sizeof(Entry));
+
+    ValueArray array;
+    initValueArray(&array);
+    for (int i = 0; i < VALUE_COUNT; i++) {
+        writeValueArray(&array, mixedValue(i));
+    }
+
+    benchArrayScan(&array);
+    benchEquality(&array);
+    benchTable();
+
+    freeValueArray(&array);
+    freeVM();
+    return 0;
+}
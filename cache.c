@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+#include "cache.h"
+#include "hash.h"
+#include "object.h"
+#include "registers.h"
+#include "vm.h"
+
+// A .loxc file is laid out so that it can be used where it's mapped:
+//
+//   CacheHeader
+//   LineStart lines[lineCount], the chunk's run-length encoded line table
+//   uint8_t code[codeCount]
+//   the constants, one after another: a CacheTag byte, then
+//     a number's 8 bytes, or a string's uint32_t length and its characters (no NUL)
+//
+// The lines and the code are used in place, straight out of the mapping. Only the constants are
+// rebuilt, since strings have to be interned (and numbers copied into Values, whatever their representation).
+// Everything is in the byte order of the machine that wrote it. A file from the other byte order
+// fails the magic check and is simply recompiled.
+//
+// A file is only used if it was written by this version of the format for exactly this source,
+// going by its length and 64-bit hash, and if the rest of it hashes to what the header says,
+// which catches a file that's been truncated or damaged.
+// Bump CACHE_VERSION whenever the opcodes or the layout change.
+
+#define CACHE_MAGIC 0x43584f4c // "LOXC"
+#define CACHE_VERSION 4
+
+_Static_assert(sizeof(LineStart) == 2 * sizeof(int32_t), "the line table is used in place as the chunk's");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    uint64_t payloadHash; // of everything after the header
+    uint32_t codeCount;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    uint16_t format;        // a CodeFormat
+    uint16_t registerCount; // for FORMAT_REGISTER
+    uint64_t payloadSize;
+} CacheHeader;
+
+typedef enum {
+    CACHE_NIL,
+    CACHE_FALSE,
+    CACHE_TRUE,
+    CACHE_NUMBER,
+    CACHE_STRING,
+} CacheTag;
+
+uint64_t hashSource(const char* source, size_t length) {
+    return hashWords64(source, length);
+}
+
+// foo.lox caches to foo.loxc; any other name just gets .loxc on the end.
+char* cachePathFor(const char* path) {
+    size_t length = strlen(path);
+    char* cachePath = (char*)malloc(length + 6);
+    if (cachePath == NULL) return NULL;
+    memcpy(cachePath, path, length + 1);
+    if (length >= 4 && strcmp(path + length - 4, ".lox") == 0) {
+        strcpy(cachePath + length, "c");
+    } else {
+        strcpy(cachePath + length, ".loxc");
+    }
+    return cachePath;
+}
+
+// The file is assembled in memory, since its header needs the hash of everything after it.
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+static void append(Buffer* buffer, const void* bytes, size_t count) {
+    if (buffer->count + count > buffer->capacity) {
+        size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+        while (capacity < buffer->count + count) capacity *= 2;
+        buffer->bytes = (uint8_t*)realloc(buffer->bytes, capacity);
+        if (buffer->bytes == NULL) exit(1);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+static bool appendConstant(Buffer* buffer, Value value) {
+    uint8_t tag;
+    if (IS_NIL(value)) {
+        tag = CACHE_NIL;
+        append(buffer, &tag, 1);
+    } else if (IS_BOOL(value)) {
+        tag = AS_BOOL(value) ? CACHE_TRUE : CACHE_FALSE;
+        append(buffer, &tag, 1);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        tag = CACHE_NUMBER;
+        append(buffer, &tag, 1);
+        append(buffer, &number, sizeof(number));
+    } else if (IS_STRING(value)) {
+        ObjString* string = AS_STRING(value);
+        uint32_t length = (uint32_t)string->length;
+        tag = CACHE_STRING;
+        append(buffer, &tag, 1);
+        append(buffer, &length, sizeof(length));
+        append(buffer, string->chars, string->length);
+    } else {
+        // The compiler only ever makes flat strings, but a constant that can't be saved just means no cache.
+        return false;
+    }
+    return true;
+}
+
+// The file is written under a temporary name and then renamed into place,
+// so a script started at the same moment sees either the old file or the whole new one, never half of it.
+// Failing to write the cache, to a read-only directory say, isn't an error: the script runs anyway.
+bool saveChunk(const char* path, const Chunk* chunk, uint64_t sourceHash, size_t sourceLength) {
+    Buffer buffer = {NULL, 0, 0};
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    append(&buffer, &header, sizeof(header));
+
+    append(&buffer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+    append(&buffer, chunk->code, chunk->count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!appendConstant(&buffer, chunk->constants.values[i])) {
+            free(buffer.bytes);
+            return false;
+        }
+    }
+
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.sourceHash = sourceHash;
+    header.sourceLength = sourceLength;
+    header.codeCount = (uint32_t)chunk->count;
+    header.lineCount = (uint32_t)chunk->lineCount;
+    header.constantCount = (uint32_t)chunk->constants.count;
+    header.format = (uint16_t)chunk->format;
+    header.registerCount = (uint16_t)chunk->registerCount;
+    header.payloadSize = buffer.count - sizeof(header);
+    header.payloadHash = hashWords64((const char*)buffer.bytes + sizeof(header), header.payloadSize);
+    memcpy(buffer.bytes, &header, sizeof(header));
+
+    // The VM's address keeps apart threads of one process that are saving the same script.
+    size_t length = strlen(path);
+    char* temporary = (char*)malloc(length + 48);
+    if (temporary == NULL) exit(1);
+#ifdef HAVE_MMAP
+    snprintf(temporary, length + 48, "%s.%ld.%lx.tmp", path, (long)getpid(), (unsigned long)(uintptr_t)vm);
+#else
+    snprintf(temporary, length + 48, "%s.%lx.tmp", path, (unsigned long)(uintptr_t)vm);
+#endif
+
+    bool saved = false;
+    FILE* file = fopen(temporary, "wb");
+    if (file != NULL) {
+        saved = fwrite(buffer.bytes, 1, buffer.count, file) == buffer.count;
+        saved = fclose(file) == 0 && saved;
+        if (saved) saved = rename(temporary, path) == 0;
+        if (!saved) remove(temporary);
+    }
+
+    free(temporary);
+    free(buffer.bytes);
+    return saved;
+}
+
+// Maps the whole file, or failing that reads it into memory.
+static bool openImage(const char* path, ChunkImage* image) {
+    image->base = NULL;
+    image->size = 0;
+    image->mapped = false;
+
+#ifdef HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    void* base = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base != MAP_FAILED) {
+        image->base = base;
+        image->size = (size_t)info.st_size;
+        image->mapped = true;
+        return true;
+    }
+#endif
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    if (size < (long)sizeof(CacheHeader)) {
+        fclose(file);
+        return false;
+    }
+    image->base = malloc((size_t)size);
+    if (image->base == NULL) exit(1);
+    image->size = (size_t)size;
+    bool read = fread(image->base, 1, image->size, file) == image->size;
+    fclose(file);
+    if (!read) unloadChunk(image);
+    return read;
+}
+
+void unloadChunk(ChunkImage* image) {
+    if (image->base == NULL) return;
+#ifdef HAVE_MMAP
+    if (image->mapped) {
+        munmap(image->base, image->size);
+    } else {
+        free(image->base);
+    }
+#else
+    free(image->base);
+#endif
+    image->base = NULL;
+    image->size = 0;
+}
+
+// Reads the constants, bounds-checking every one. The strings are interned through copyString(),
+// which can set off a collection, so the chunk is made vm->chunk while they're added: that makes its
+// constants roots.
+static bool readConstants(Chunk* chunk, const uint8_t* p, const uint8_t* end, uint32_t count) {
+    Chunk* enclosing = vm->chunk;
+    vm->chunk = chunk;
+
+    bool ok = true;
+    for (uint32_t i = 0; i < count && ok; i++) {
+        if (p >= end) {
+            ok = false;
+            break;
+        }
+        switch ((CacheTag)*p++) {
+            case CACHE_NIL: addConstant(chunk, NIL_VAL); break;
+            case CACHE_FALSE: addConstant(chunk, BOOL_VAL(false)); break;
+            case CACHE_TRUE: addConstant(chunk, BOOL_VAL(true)); break;
+            case CACHE_NUMBER: {
+                double number;
+                if ((size_t)(end - p) < sizeof(number)) {
+                    ok = false;
+                    break;
+                }
+                memcpy(&number, p, sizeof(number));
+                p += sizeof(number);
+                addConstant(chunk, NUMBER_VAL(number));
+                break;
+            }
+            case CACHE_STRING: {
+                uint32_t length;
+                if ((size_t)(end - p) < sizeof(length)) {
+                    ok = false;
+                    break;
+                }
+                memcpy(&length, p, sizeof(length));
+                p += sizeof(length);
+                if ((size_t)(end - p) < length || length > INT32_MAX) {
+                    ok = false;
+                    break;
+                }
+                addConstant(chunk, OBJ_VAL(copyString((const char*)p, (int)length)));
+                p += length;
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+    }
+
+    vm->chunk = enclosing;
+    return ok && p == end;
+}
+
+// getLine() relies on the runs starting at 0 and going up, and staying inside the code.
+static bool validLines(const LineStart* lines, uint32_t lineCount, uint32_t codeCount) {
+    if ((lineCount == 0) != (codeCount == 0)) return false;
+    for (uint32_t i = 0; i < lineCount; i++) {
+        int previous = i == 0 ? -1 : lines[i - 1].offset;
+        if (lines[i].offset <= previous || (uint32_t)lines[i].offset >= codeCount) return false;
+    }
+    return lineCount == 0 || lines[0].offset == 0;
+}
+
+// Fills chunk, which must be freshly initialized, from the cache file at path, if it's there and fresh.
+// A file compiled to the other instruction set than vm->codeFormat asks for counts as stale.
+// On success the chunk's code and lines point into image, which the caller unloads once it's done with
+// the chunk. On failure the chunk may hold some constants, and has to be freed before it's reused.
+// The chunk has to have an arena, since that's what makes freeing its arrays do nothing.
+bool loadChunk(const char* path, Chunk* chunk, ChunkImage* image, uint64_t sourceHash, size_t sourceLength) {
+    if (chunk->arena == NULL) return false;
+    if (!openImage(path, image)) return false;
+
+    CacheHeader header;
+    memcpy(&header, image->base, sizeof(header));
+    const uint8_t* payload = (const uint8_t*)image->base + sizeof(header);
+    uint64_t payloadSize = image->size - sizeof(header);
+
+    if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION ||
+        header.sourceLength != sourceLength || header.sourceHash != sourceHash ||
+        header.format != (uint16_t)vm->codeFormat || header.registerCount > REGISTER_MAX ||
+        header.payloadSize != payloadSize ||
+        header.codeCount > INT32_MAX || header.lineCount > header.codeCount ||
+        (uint64_t)header.lineCount * sizeof(LineStart) + header.codeCount > payloadSize ||
+        header.payloadHash != hashWords64((const char*)payload, payloadSize)) {
+        unloadChunk(image);
+        return false;
+    }
+
+    // The code is never written once it's compiled, so it can be used straight from a read-only mapping.
+    LineStart* lines = (LineStart*)payload;
+    if (!validLines(lines, header.lineCount, header.codeCount)) {
+        unloadChunk(image);
+        return false;
+    }
+    chunk->lines = lines;
+    chunk->lineCount = (int)header.lineCount;
+    chunk->lineCapacity = (int)header.lineCount;
+    chunk->code = (uint8_t*)payload + header.lineCount * sizeof(LineStart);
+    chunk->count = (int)header.codeCount;
+    chunk->capacity = (int)header.codeCount;
+    chunk->format = (CodeFormat)header.format;
+    chunk->registerCount = (int)header.registerCount;
+
+    const uint8_t* constants = chunk->code + header.codeCount;
+    if (!readConstants(chunk, constants, payload + payloadSize, header.constantCount)) {
+        chunk->lines = NULL;
+        chunk->lineCount = 0;
+        chunk->lineCapacity = 0;
+        chunk->code = NULL;
+        chunk->count = 0;
+        chunk->capacity = 0;
+        unloadChunk(image);
+        return false;
+    }
+    return true;
+}
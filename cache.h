@@ -0,0 +1,23 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "chunk.h"
+
+// A compiled chunk saved to disk, so that running an unchanged script can skip scanning and compiling.
+// The file for foo.lox is foo.loxc, next to it. See cache.c for the format.
+
+// A .loxc file mapped into memory. A chunk loaded from it points into the mapping,
+// so the mapping has to outlive the chunk.
+typedef struct {
+    void* base;
+    size_t size;
+    bool mapped; // or read into memory, where mapping isn't available
+} ChunkImage;
+
+uint64_t hashSource(const char* source, size_t length);
+char* cachePathFor(const char* path);
+bool saveChunk(const char* path, const Chunk* chunk, uint64_t sourceHash, size_t sourceLength);
+bool loadChunk(const char* path, Chunk* chunk, ChunkImage* image, uint64_t sourceHash, size_t sourceLength);
+void unloadChunk(ChunkImage* image);
+
+#endif
@@ -5,39 +5,148 @@
 
 
 // no ctor like java, so we need a init func
-void initChunk(Chunk* chunk) {
+void initChunk(Chunk* chunk, Arena* arena) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->globalSlots = NULL;
+    chunk->arena = arena;
+    chunk->format = FORMAT_STACK;
+    chunk->registerCount = 0;
     initValueArray(&chunk->constants);
+    chunk->constants.arena = arena;
 }
 
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    ARENA_FREE_ARRAY(chunk->arena, uint8_t, chunk->code, chunk->capacity);
+    ARENA_FREE_ARRAY(chunk->arena, LineStart, chunk->lines, chunk->lineCapacity);
+    ARENA_FREE_ARRAY(chunk->arena, int, chunk->globalSlots, chunk->constants.capacity);
     freeValueArray(&chunk->constants);
-    initChunk(chunk);
+    initChunk(chunk, chunk->arena);
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code,
+        chunk->code = ARENA_GROW_ARRAY(chunk->arena, uint8_t, chunk->code,
             oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines,
-        oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
+    addLine(chunk, chunk->count, line);
     chunk->count++;
 }
 
+// Records that the code from offset on comes from line, unless the run before it is on that line already.
+// Offsets have to be added in increasing order.
+void addLine(Chunk* chunk, int offset, int line) {
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = ARENA_GROW_ARRAY(chunk->arena, LineStart, chunk->lines,
+            oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart* start = &chunk->lines[chunk->lineCount++];
+    start->offset = offset;
+    start->line = line;
+}
+
+// The line of the byte at offset: that of the last run starting at or before it, found by binary search.
+// Only errors and the disassembler ever ask, so the lookup doesn't need to be faster than that.
+int getLine(Chunk* chunk, int offset) {
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
+
+// Cuts the code back to its first count bytes, along with the runs of lines that only covered what was cut.
+void truncateChunk(Chunk* chunk, int count) {
+    chunk->count = count;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count) {
+        chunk->lineCount--;
+    }
+}
+
+// Empties the chunk but keeps its arrays, for the next thing compiled into it to reuse.
+void resetChunk(Chunk* chunk) {
+    chunk->count = 0;
+    chunk->lineCount = 0;
+    chunk->constants.count = 0;
+    chunk->format = FORMAT_STACK;
+    chunk->registerCount = 0;
+}
+
+// The length in bytes of an instruction with the given opcode, operands included, in either instruction set.
+int instructionLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+        case OP_LESS_CONSTANT:
+        case OP_GREATER_CONSTANT:
+        case OP_GET_GLOBAL_ADD:
+        case OP_REG_PRINT:
+            return 2;
+        case OP_REG_LOAD_CONSTANT:
+        case OP_REG_GET_GLOBAL:
+        case OP_REG_DEFINE_GLOBAL:
+        case OP_REG_SET_GLOBAL:
+        case OP_REG_NOT:
+        case OP_REG_NEGATE:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_REG_EQUAL:
+        case OP_REG_GREATER:
+        case OP_REG_LESS:
+        case OP_REG_ADD:
+        case OP_REG_SUBTRACT:
+        case OP_REG_MULTIPLY:
+        case OP_REG_DIVIDE:
+        case OP_REG_ADD_GLOBAL:
+            return 4;
+        case OP_REG_LOAD_CONSTANT_LONG:
+        case OP_REG_GET_GLOBAL_LONG:
+        case OP_REG_DEFINE_GLOBAL_LONG:
+        case OP_REG_SET_GLOBAL_LONG:
+            return 5;
+        default:
+            return 1;
+    }
+}
+
 int addConstant(Chunk* chunk, Value value) {
+    int oldCapacity = chunk->constants.capacity;
     writeValueArray(&chunk->constants, value);
 
+    // Every constant gets an empty inline cache, whether or not it ends up naming a global.
+    // A per-constant int is cheaper than working out which ones do.
+    if (chunk->constants.capacity != oldCapacity) {
+        chunk->globalSlots = ARENA_GROW_ARRAY(chunk->arena, int, chunk->globalSlots,
+            oldCapacity, chunk->constants.capacity);
+    }
+    chunk->globalSlots[chunk->constants.count - 1] = -1;
+
     // we return the index where the constant was appended
     // so that we can locate that same constant later.
     return chunk->constants.count - 1;
@@ -3,6 +3,7 @@
 
 
 #include "common.h"
+#include "memory.h"
 #include "value.h"
 
 typedef enum {
@@ -25,23 +26,95 @@ typedef enum {
     OP_DIVIDE,
     OP_NOT,
     OP_RETURN,
+    // Superinstructions: the compiler fuses an operator with the OP_CONSTANT or OP_GET_GLOBAL
+    // that loads its right operand, so the pair costs one dispatch instead of two.
+    // The operand byte is the constant table index of the value or of the global's name.
+    OP_ADD_CONSTANT,
+    OP_SUBTRACT_CONSTANT,
+    OP_LESS_CONSTANT,
+    OP_GREATER_CONSTANT,
+    OP_GET_GLOBAL_ADD,
+    // The long forms of the instructions that take a constant index, for chunks with more than 256 constants.
+    // The index is three bytes, least significant first, so a chunk can have up to 2^24 constants.
+    OP_CONSTANT_LONG,
+    OP_GET_GLOBAL_LONG,
+    OP_DEFINE_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    // The register instructions, which a chunk in FORMAT_REGISTER has instead of all of the above; see registers.h.
+    // Every operand is a byte: d is the register the result goes in,
+    // a and b are frame slots, each a register or a constant, and k is a constant table index,
+    // three bytes in the long forms like the stack instructions'.
+    OP_REG_LOAD_CONSTANT,       // d k
+    OP_REG_LOAD_CONSTANT_LONG,
+    OP_REG_GET_GLOBAL,          // d k
+    OP_REG_GET_GLOBAL_LONG,
+    OP_REG_DEFINE_GLOBAL,       // a k
+    OP_REG_DEFINE_GLOBAL_LONG,
+    OP_REG_SET_GLOBAL,          // a k
+    OP_REG_SET_GLOBAL_LONG,
+    OP_REG_EQUAL,               // d a b
+    OP_REG_GREATER,
+    OP_REG_LESS,
+    OP_REG_ADD,
+    OP_REG_SUBTRACT,
+    OP_REG_MULTIPLY,
+    OP_REG_DIVIDE,
+    OP_REG_ADD_GLOBAL,          // d a k, OP_GET_GLOBAL_ADD's counterpart
+    OP_REG_NOT,                 // d a
+    OP_REG_NEGATE,
+    OP_REG_PRINT,               // a
+    OP_REG_RETURN,
   } OpCode;
 
+// One more than the last opcode, for tables with an entry per opcode.
+#define OP_COUNT (OP_REG_RETURN + 1)
+
+// Which of the two instruction sets a chunk's code is in.
+// compile() emits FORMAT_STACK unless vm->codeFormat asks for the other.
+typedef enum {
+    FORMAT_STACK,
+    FORMAT_REGISTER,
+} CodeFormat;
+
+#define MAX_CONSTANTS (1 << 24)
+
+// The line table is run-length encoded: one entry for each run of bytes that came from the same line,
+// giving the offset where the run starts. Most lines compile to several bytes of code,
+// so this is far smaller than a line for every byte.
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 // Dynamic arrays provide:
 // - Cache-friendly, dense storage
 // - Constant-time indexed element lookup
 // - Constant-time appending to the end of the array (amortized)
 typedef struct {
     uint8_t* code;
-    int* lines;  // Each number in the array is the line number for the corresponding byte in the bytecode.
+    LineStart* lines; // in order of offset, the first starting at 0; see getLine()
+    int lineCount;
+    int lineCapacity;
     ValueArray constants;
+    // The inline caches of the global variable instructions, parallel to constants.
+    // globalSlots[i] is the bucket of vm->globals where the global named by constant i was last found,
+    // or -1 if it hasn't been looked up yet. It's only a hint: see findGlobal() in vm.c.
+    int* globalSlots;
     int count;    // the number of elements are actually in use
     int capacity; // the number of elements in the array we have allocated
+    Arena* arena; // where the arrays are allocated, or NULL for the heap
+    CodeFormat format;
+    int registerCount; // in FORMAT_REGISTER, how many registers the code uses
 } Chunk;
 
-void initChunk(Chunk* chunk);
+void initChunk(Chunk* chunk, Arena* arena);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void addLine(Chunk* chunk, int offset, int line);
+int getLine(Chunk* chunk, int offset);
+void truncateChunk(Chunk* chunk, int count);
+void resetChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+int instructionLength(uint8_t instruction);
 
 #endif
\ No newline at end of file
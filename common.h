@@ -5,7 +5,15 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// DEBUG_PRINT_CODE and DEBUG_TRACE_EXECUTION come from CMake, in Debug builds only.
+// Even then they do nothing unless asked for at run time: see vm->printCode and vm->traceExecution.
+
+// Every thread can run a VM of its own (see vm.h), so what the interpreter keeps outside of the VM,
+// like the compiler's state, is kept once per thread.
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
 
 #endif
\ No newline at end of file
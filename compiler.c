@@ -1,12 +1,17 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "hash.h"
+#include "memory.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
+#include "optimizer.h"
+#include "registers.h"
 #include "scanner.h"
 
 
@@ -19,6 +24,7 @@ typedef struct {
     Token previous;
     bool hadError;
     bool panicMode;
+    bool starved; // compileBatch() ran out of source part way through a declaration
 } Parser;
 
 // These are all of Lox’s precedence levels in order from lowest to highest.
@@ -49,9 +55,33 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
-Parser parser;
+// The compiler's state only lives as long as one call to compile(), and a thread only ever compiles
+// one thing at a time, so it's kept per thread rather than in the VM.
+static THREAD_LOCAL Parser parser;
 
-Chunk* compilingChunk;
+static THREAD_LOCAL Chunk* compilingChunk;
+
+// Finds the index of a constant already in the chunk being compiled, so that a value used over and over,
+// like a global's name, a number or a string literal, takes up one slot in the constant table.
+// For a global, sharing the constant also means every instruction naming it shares one inline cache.
+// It's an open-addressed hash table of indices into the chunk's constants, -1 meaning an empty bucket,
+// and it lives in the chunk's arena along with the chunk.
+typedef struct {
+    int* buckets;
+    int capacity; // a power of two
+    int count;
+} ConstantIndex;
+
+static THREAD_LOCAL ConstantIndex constantIndex;
+
+// Where the code for the expression that an infix operator's left operand belongs to begins,
+// and how many constants the chunk had then.
+// parsePrecedence() sets them just before calling the infix rule, which has to read them before parsing anything else.
+static THREAD_LOCAL int leftOperandStart;
+static THREAD_LOCAL int leftOperandConstants;
+
+// While compileBatch() works on a piece of a source that goes on after it, the end of the piece.
+static THREAD_LOCAL const char* pieceEnd;
 
 static Chunk* currentChunk() {
     return compilingChunk;
@@ -61,6 +91,13 @@ static Chunk* currentChunk() {
 static void errorAt(Token* token, const char* message) {
     if (parser.panicMode) return;
     parser.panicMode = true;
+    // Once the scanner has reached the end of a piece, the error may only be that the rest of the declaration
+    // is still to come, so compileBatch() leaves the declaration for the next piece instead of reporting it.
+    // Should it really be an error, it's reported then.
+    if (pieceEnd != NULL && scannerPosition() == pieceEnd) {
+        parser.starved = true;
+        return;
+    }
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -132,25 +169,227 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
-    int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+// Strings are interned, so they're the same constant exactly when they're the same object.
+// Numbers go by their bits: 0 and -0 are equal but behave differently (1 / -0 is -inf),
+// so they need a constant each, while a NaN, which isn't equal even to itself, is one constant like any other.
+static uint32_t hashConstant(Value value) {
+    if (IS_STRING(value)) return AS_STRING(value)->hash;
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        uint64_t hash = hashMix(bits ^ hashSecret[0], hashSecret[1]);
+        return (uint32_t)(hash ^ (hash >> 32));
+    }
+    if (IS_BOOL(value)) return AS_BOOL(value) ? 1 : 2;
+    return 3;
+}
+
+static bool sameConstant(Value a, Value b) {
+    if (IS_NUMBER(a) || IS_NUMBER(b)) {
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
+}
+
+// Returns the bucket holding value's index, or the empty bucket where it belongs.
+static int* findConstant(Value value) {
+    Value* constants = currentChunk()->constants.values;
+    uint32_t mask = (uint32_t)constantIndex.capacity - 1;
+    for (uint32_t bucket = hashConstant(value) & mask;; bucket = (bucket + 1) & mask) {
+        int* index = &constantIndex.buckets[bucket];
+        if (*index == -1 || sameConstant(constants[*index], value)) return index;
+    }
+}
+
+static void growConstantIndex() {
+    Chunk* chunk = currentChunk();
+    int oldCapacity = constantIndex.capacity;
+    int* oldBuckets = constantIndex.buckets;
+
+    constantIndex.capacity = oldCapacity < 16 ? 16 : oldCapacity * 2;
+    constantIndex.buckets = ARENA_ALLOCATE(chunk->arena, int, constantIndex.capacity);
+    memset(constantIndex.buckets, -1, sizeof(int) * constantIndex.capacity);
+    for (int i = 0; i < oldCapacity; i++) {
+        if (oldBuckets[i] != -1) *findConstant(chunk->constants.values[oldBuckets[i]]) = oldBuckets[i];
+    }
+    ARENA_FREE_ARRAY(chunk->arena, int, oldBuckets, oldCapacity);
+}
+
+// Takes the constants from count on back out of the chunk and the index, for when the code that used them is cut.
+// Constants are only ever shared with code compiled after them, so the code that came before doesn't need them.
+// The index is open-addressed with linear probing, so each removal shifts back the entries probed past it.
+static void truncateConstants(int count) {
+    ValueArray* constants = &currentChunk()->constants;
+    uint32_t mask = (uint32_t)constantIndex.capacity - 1;
+    while (constants->count > count) {
+        Value value = constants->values[constants->count - 1];
+        uint32_t hole = (uint32_t)(findConstant(value) - constantIndex.buckets);
+        for (uint32_t bucket = (hole + 1) & mask; constantIndex.buckets[bucket] != -1; bucket = (bucket + 1) & mask) {
+            uint32_t home = hashConstant(constants->values[constantIndex.buckets[bucket]]) & mask;
+            // The entry can move to the hole unless its home bucket lies after the hole, up to where it is.
+            if (((bucket - home) & mask) >= ((bucket - hole) & mask)) {
+                constantIndex.buckets[hole] = constantIndex.buckets[bucket];
+                hole = bucket;
+            }
+        }
+        constantIndex.buckets[hole] = -1;
+        constantIndex.count--;
+        constants->count--;
+    }
+}
+
+static int makeConstant(Value value) {
+    // Kept at most half full, so that a probe is short and always finds an empty bucket.
+    if ((constantIndex.count + 1) * 2 > constantIndex.capacity) growConstantIndex();
+
+    int* index = findConstant(value);
+    if (*index != -1) return *index;
+
+    if (currentChunk()->constants.count == MAX_CONSTANTS) {
         error("Too many constants in one chunk.");
         return 0;
     }
+    *index = addConstant(currentChunk(), value);
+    constantIndex.count++;
+    return *index;
+}
 
-    return (uint8_t)constant;
+// Emits an instruction that takes a constant index,
+// using its long form when the index doesn't fit in the one byte of the short one.
+static void emitIndexed(OpCode op, OpCode longOp, int index) {
+    if (index <= UINT8_MAX) {
+        emitBytes(op, (uint8_t)index);
+        return;
+    }
+    emitByte(longOp);
+    emitByte((uint8_t)(index & 0xff));
+    emitByte((uint8_t)((index >> 8) & 0xff));
+    emitByte((uint8_t)((index >> 16) & 0xff));
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitIndexed(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+}
+
+#ifdef OPTIMIZE_BYTECODE
+// Constant folding.
+// An operator whose operands turned out to be constants is evaluated right here:
+// the operands' code is cut off the end of the chunk and replaced with a load of the result.
+// Lines stay correct because truncateChunk() cuts the line table back along with the code,
+// and the result is emitted on the operator's line like the instruction it replaces.
+// Only operations that would succeed at runtime are folded, so type errors are still reported by the VM.
+
+// If the code from start to the end of the chunk is a single instruction that pushes a constant,
+// stores that constant in *value.
+static bool constantOperand(int start, int end, Value* value) {
+    Chunk* chunk = currentChunk();
+    if (end - start == 1) {
+        switch (chunk->code[start]) {
+            case OP_NIL:   *value = NIL_VAL; return true;
+            case OP_TRUE:  *value = BOOL_VAL(true); return true;
+            case OP_FALSE: *value = BOOL_VAL(false); return true;
+            default:       return false;
+        }
+    }
+
+    if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+        *value = chunk->constants.values[chunk->code[start + 1]];
+        return true;
+    }
+
+    if (end - start == 4 && chunk->code[start] == OP_CONSTANT_LONG) {
+        uint8_t* operand = &chunk->code[start + 1];
+        *value = chunk->constants.values[operand[0] | (operand[1] << 8) | (operand[2] << 16)];
+        return true;
+    }
+
+    return false;
 }
 
+static bool isFalseyConstant(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Each case mirrors what the corresponding instruction sequence does in run(),
+// e.g. a >= b is compiled as !(a < b), which isn't the same as a >= b when one of them is NaN.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+    switch (operatorType) {
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+        default: break;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        *result = OBJ_VAL(concatenateStrings(AS_STRING(a), AS_STRING(b)));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+        case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+        default:                  return false;
+    }
+}
+
+static bool foldUnary(TokenType operatorType, Value operand, Value* result) {
+    switch (operatorType) {
+        case TOKEN_BANG:
+            *result = BOOL_VAL(isFalseyConstant(operand));
+            return true;
+        case TOKEN_MINUS:
+            if (!IS_NUMBER(operand)) return false;
+            *result = NUMBER_VAL(-AS_NUMBER(operand));
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Replaces everything from start to the end of the chunk with code that pushes value.
+// The constants added since there were only the operands', so they go too,
+// rather than staying in the chunk (and its .loxc file) with nothing using them.
+static void replaceWithConstant(int start, int constantCount, Value value) {
+    truncateChunk(currentChunk(), start);
+    truncateConstants(constantCount);
+
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+#endif
+
 
 static void endCompiler() {
     emitReturn();
-#ifdef DEBUG_PRINT_CODE
+#ifdef OPTIMIZE_BYTECODE
     if (!parser.hadError) {
+        optimizeChunk(currentChunk());
+    }
+#endif
+    // The register code is made from the finished stack code, so the stack code is always compiled first.
+    if (vm->codeFormat == FORMAT_REGISTER && !parser.hadError) {
+        generateRegisterCode(currentChunk());
+    }
+#ifdef DEBUG_PRINT_CODE
+    if (vm->printCode && !parser.hadError) {
         disassembleChunk(currentChunk(), "code");
     }
 #endif
@@ -162,25 +401,50 @@ static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(copyString(name->start,
-                                           name->length)));
+static int identifierConstant(Token* name) {
+    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
     return identifierConstant(&parser.previous);
 }
 
 // A whole string is too big to stuff into the bytecode stream as an operand.
 // Instead, we store the string in the constant table
-// and the instruction then refers to the name by its index (uint8_t global) in the table
-static void defineVariable(uint8_t global) {
-    emitBytes(OP_DEFINE_GLOBAL, global);
+// and the instruction then refers to the name by its index (global) in the table
+static void defineVariable(int global) {
+    emitIndexed(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
+}
+// Emits the instruction for a binary operator whose right operand was compiled starting at operandStart.
+// When that operand is a lone OP_CONSTANT (or OP_GET_GLOBAL) and the operator has a fused form,
+// the load is rewritten in place into constantOp (or globalOp), which keeps its operand byte and line.
+// Pass -1 for a fused form the operator doesn't have.
+static void emitBinary(OpCode op, int operandStart, int constantOp, int globalOp) {
+    Chunk* chunk = currentChunk();
+
+    // Both loads are two bytes, so anything longer is a larger expression.
+    if (chunk->count - operandStart == 2) {
+        uint8_t* load = &chunk->code[operandStart];
+        if (*load == OP_CONSTANT && constantOp != -1) {
+            *load = (uint8_t)constantOp;
+            return;
+        }
+        if (*load == OP_GET_GLOBAL && globalOp != -1) {
+            *load = (uint8_t)globalOp;
+            return;
+        }
+    }
+
+    emitByte(op);
 }
+
 static void binary(bool canAssign) {
+    int leftStart = leftOperandStart;
+    int leftConstants = leftOperandConstants;
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    int operandStart = currentChunk()->count;
     /**
     * why precedence + 1?
     * 用「比該 operator 高一級的 precedence」來解析，這樣可以正確處理左結合(left-associative)
@@ -197,15 +461,45 @@ static void binary(bool canAssign) {
     */
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+#ifdef OPTIMIZE_BYTECODE
+    Value a;
+    Value b;
+    Value result;
+    int end = currentChunk()->count;
+    if (constantOperand(leftStart, operandStart, &a) &&
+        constantOperand(operandStart, end, &b) &&
+        foldBinary(operatorType, a, b, &result)) {
+        replaceWithConstant(leftStart, leftConstants, result);
+        return;
+    }
+#else
+    (void)leftStart;
+    (void)leftConstants;
+#endif
+
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emitByte(OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
+        case TOKEN_GREATER:
+            emitBinary(OP_GREATER, operandStart, OP_GREATER_CONSTANT, -1);
+            break;
+        case TOKEN_GREATER_EQUAL:
+            emitBinary(OP_LESS, operandStart, OP_LESS_CONSTANT, -1);
+            emitByte(OP_NOT);
+            break;
+        case TOKEN_LESS:
+            emitBinary(OP_LESS, operandStart, OP_LESS_CONSTANT, -1);
+            break;
+        case TOKEN_LESS_EQUAL:
+            emitBinary(OP_GREATER, operandStart, OP_GREATER_CONSTANT, -1);
+            emitByte(OP_NOT);
+            break;
+        case TOKEN_PLUS:
+            emitBinary(OP_ADD, operandStart, OP_ADD_CONSTANT, OP_GET_GLOBAL_ADD);
+            break;
+        case TOKEN_MINUS:
+            emitBinary(OP_SUBTRACT, operandStart, OP_SUBTRACT_CONSTANT, -1);
+            break;
         case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
         case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
         default: return; // Unreachable.
@@ -241,15 +535,15 @@ static void string(bool canAssign) {
 }
 
 static void namedVariable(Token name, bool canAssign) {
-    uint8_t arg = identifierConstant(&name);
+    int arg = identifierConstant(&name);
 
     // we look for an equals sign after the identifier
     // variable() should look for and consume the = only if it’s in the context of a low-precedence expression
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_GLOBAL, arg);
+        emitIndexed(OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, arg);
     } else {
-        emitBytes(OP_GET_GLOBAL, arg);
+        emitIndexed(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, arg);
     }
 }
 
@@ -262,11 +556,26 @@ static void variable(bool canAssign) {
 static void unary(bool canAssign) {
     // the leading token has been consumed and in parser.previous
     TokenType operatorType = parser.previous.type;
+    int operandStart = currentChunk()->count;
+    int operandConstants = currentChunk()->constants.count;
 
     // Compile the operand.
     // we call this to limit it to the appropriate level
     parsePrecedence(PREC_UNARY);
 
+#ifdef OPTIMIZE_BYTECODE
+    Value operand;
+    Value result;
+    if (constantOperand(operandStart, currentChunk()->count, &operand) &&
+        foldUnary(operatorType, operand, &result)) {
+        replaceWithConstant(operandStart, operandConstants, result);
+        return;
+    }
+#else
+    (void)operandStart;
+    (void)operandConstants;
+#endif
+
     // Emit the operator instruction.
     switch (operatorType) {
         case TOKEN_BANG: emitByte(OP_NOT); break;
@@ -348,6 +657,8 @@ static void parsePrecedence(Precedence precedence) {
     // variable() doesn’t take into account the precedence of
     // the surrounding expression that contains the variable
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int start = currentChunk()->count;
+    int startConstants = currentChunk()->constants.count;
 
     // call it
     // That prefix parser compiles the rest of the prefix expression,
@@ -361,6 +672,9 @@ static void parsePrecedence(Precedence precedence) {
         // same logic like above
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        // Whatever has been compiled since start is the infix operator's left operand.
+        leftOperandStart = start;
+        leftOperandConstants = startConstants;
         infixRule(canAssign);
     }
 
@@ -395,7 +709,7 @@ static void expressionStatement() {
 
 
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
@@ -471,19 +785,88 @@ declaration    → varDecl
 
 
  */
-bool compile(const char* source, Chunk* chunk) {
-    initScanner(source);
+static void beginCompiler(const char* source, int line, Chunk* chunk) {
+    initScannerAt(source, line);
     compilingChunk = chunk;
+    constantIndex.buckets = NULL;
+    constantIndex.capacity = 0;
+    constantIndex.count = 0;
 
     parser.hadError = false;
     parser.panicMode = false;
+    parser.starved = false;
 
     advance(); // kick off, to get the first token
+}
+
+bool compile(const char* source, Chunk* chunk) {
+    pieceEnd = NULL;
+    beginCompiler(source, 1, chunk);
 
     while (!match(TOKEN_EOF)) {
         declaration();
     }
 
     endCompiler();
+    ARENA_FREE_ARRAY(chunk->arena, int, constantIndex.buckets, constantIndex.capacity);
+    compilingChunk = NULL;
     return !parser.hadError;
+}
+
+// compile() for a source that comes a piece at a time; see interpretStream() in vm.c.
+// piece holds length characters followed by a '\0', and is the last piece of the source if final.
+// The declarations in it that are complete are compiled into chunk, starting on line *line.
+// *consumed is set to how many characters they took, and *line to the line they end on.
+// Whatever is left is the start of a declaration that goes on in the next piece, so it has to come again,
+// at the front of that one. A piece that holds no complete declaration consumes nothing.
+BatchResult compileBatch(const char* piece, size_t length, bool final, Chunk* chunk,
+                         size_t* consumed, int* line) {
+    pieceEnd = final ? NULL : piece + length;
+    beginCompiler(piece, *line, chunk);
+
+    // Every declaration ends with a ';' that can't be the start of a longer token,
+    // so the piece can be cut right after the last one that compiled.
+    const char* resume = piece;
+    int resumeLine = *line;
+    int resumeCount = chunk->count;
+    int resumeConstants = chunk->constants.count;
+    bool finished = false;
+    for (;;) {
+        // The lookahead token may be cut short by the end of the piece, and then so may the declaration it starts.
+        if (pieceEnd != NULL && scannerPosition() == pieceEnd) break;
+        if (check(TOKEN_EOF)) {
+            finished = true;
+            break;
+        }
+
+        declaration();
+        if (parser.starved) break;
+        resume = parser.previous.start + parser.previous.length;
+        resumeLine = parser.previous.line;
+        resumeCount = chunk->count;
+        resumeConstants = chunk->constants.count;
+    }
+    // The declaration that was cut short comes again with the next piece, constants and all.
+    truncateChunk(chunk, resumeCount);
+    truncateConstants(resumeConstants);
+
+    endCompiler();
+    ARENA_FREE_ARRAY(chunk->arena, int, constantIndex.buckets, constantIndex.capacity);
+    compilingChunk = NULL;
+    pieceEnd = NULL;
+
+    *consumed = finished ? length : (size_t)(resume - piece);
+    *line = resumeLine;
+    if (parser.hadError) return BATCH_ERROR;
+    return finished ? BATCH_FINISHED : BATCH_COMPILED;
+}
+
+// The chunk being compiled isn't vm->chunk yet, so the collector asks for its constants here.
+// Every string the compiler makes goes into the constants before the next one is allocated.
+void markCompilerRoots() {
+    if (compilingChunk == NULL) return;
+    ValueArray* constants = &compilingChunk->constants;
+    for (int i = 0; i < constants->count; i++) {
+        markValue(constants->values[i]);
+    }
 }
\ No newline at end of file
@@ -3,6 +3,15 @@
 #include "object.h"
 #include "vm.h"
 
+typedef enum {
+    BATCH_COMPILED, // there's more of the source to come
+    BATCH_FINISHED, // and that was the end of it
+    BATCH_ERROR
+} BatchResult;
+
 bool compile(const char* source, Chunk* chunk);
+BatchResult compileBatch(const char* piece, size_t length, bool final, Chunk* chunk,
+                         size_t* consumed, int* line);
+void markCompilerRoots();
 
 #endif
\ No newline at end of file
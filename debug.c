@@ -1,39 +1,156 @@
+#include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "debug.h"
+#include "object.h"
+#include "output.h"
+#include "registers.h"
 #include "value.h"
 
+// Tracing prints the whole stack before every instruction, which is a lot of small writes.
+// They're gathered here and handed to stderr a buffer at a time, rather than one printf() each.
+// Anything that prints to stderr itself, like runtimeError(), flushes this first to keep the order.
+#define DEBUG_BUFFER_SIZE (64 * 1024)
+
+static THREAD_LOCAL char debugBuffer[DEBUG_BUFFER_SIZE];
+static THREAD_LOCAL size_t debugLength = 0;
+
+void flushDebugOutput() {
+    if (debugLength == 0) return;
+    fwrite(debugBuffer, 1, debugLength, stderr);
+    debugLength = 0;
+}
+
+void debugWrite(const char* chars, size_t length) {
+    if (debugLength + length > DEBUG_BUFFER_SIZE) {
+        flushDebugOutput();
+        if (length > DEBUG_BUFFER_SIZE) {
+            fwrite(chars, 1, length, stderr);
+            return;
+        }
+    }
+    memcpy(debugBuffer + debugLength, chars, length);
+    debugLength += length;
+}
+
+// Formats straight into the buffer; only a result too long for what's left of it needs a second go.
+void debugPrintf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    size_t space = DEBUG_BUFFER_SIZE - debugLength;
+    int length = vsnprintf(debugBuffer + debugLength, space, format, args);
+    va_end(args);
+    if (length < 0) return;
+    if ((size_t)length < space) {
+        debugLength += (size_t)length;
+        return;
+    }
+
+    flushDebugOutput();
+    va_start(args, format);
+    if (length < DEBUG_BUFFER_SIZE) {
+        debugLength = (size_t)vsnprintf(debugBuffer, DEBUG_BUFFER_SIZE, format, args);
+    } else {
+        vfprintf(stderr, format, args);
+    }
+    va_end(args);
+}
+
+// printValue() for the buffer.
+void debugPrintValue(Value value) {
+    if (IS_BOOL(value)) {
+        if (AS_BOOL(value)) {
+            debugWrite("true", 4);
+        } else {
+            debugWrite("false", 5);
+        }
+    } else if (IS_NIL(value)) {
+        debugWrite("nil", 3);
+    } else if (IS_NUMBER(value)) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        debugWrite(buffer, (size_t)formatNumber(AS_NUMBER(value), buffer));
+    } else if (IS_STRING(value)) {
+        debugWrite(AS_CSTRING(value), (size_t)AS_STRING(value)->length);
+    } else if (IS_ROPE(value)) {
+        ObjString* flat = flattenRope(AS_ROPE(value));
+        debugWrite(flat->chars, (size_t)flat->length);
+    }
+}
+
 void disassembleChunk(Chunk* chunk, const char* name) {
-    printf("== %s ==\n", name);
+    debugPrintf("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
         offset = disassembleInstruction(chunk, offset);
     }
+    flushDebugOutput();
 }
 
 static int constantInstruction(const char* name, Chunk* chunk,
                                int offset) {
     uint8_t constant = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
-    printf("'\n");
+    debugPrintf("%-20s %4d '", name, constant);
+    debugPrintValue(chunk->constants.values[constant]);
+    debugWrite("'\n", 2);
     return offset + 2;
 }
 
+static int constantLongInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+    int constant = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) |
+                   (chunk->code[offset + 3] << 16);
+    debugPrintf("%-20s %4d '", name, constant);
+    debugPrintValue(chunk->constants.values[constant]);
+    debugWrite("'\n", 2);
+    return offset + 4;
+}
+
 static int simpleInstruction(const char* name, int offset) {
-    printf("%s\n", name);
+    debugPrintf("%s\n", name);
     return offset + 1;
 }
 
+// A register instruction: its slot operands, then the constant index, one byte or three, if it has one.
+// A slot is printed as the register it is, or as the literal or constant it holds.
+static int registerInstruction(const char* name, Chunk* chunk, int offset, int slots, int indexBytes) {
+    debugPrintf("%-26s", name);
+    for (int i = 1; i <= slots; i++) {
+        uint8_t slot = chunk->code[offset + i];
+        if (slot < REGISTER_MAX) {
+            debugPrintf(" r%d", slot);
+        } else if (slot == FRAME_NIL) {
+            debugWrite(" nil", 4);
+        } else if (slot == FRAME_TRUE) {
+            debugWrite(" true", 5);
+        } else if (slot == FRAME_FALSE) {
+            debugWrite(" false", 6);
+        } else {
+            debugWrite(" '", 2);
+            debugPrintValue(chunk->constants.values[slot - FRAME_CONSTANTS]);
+            debugWrite("'", 1);
+        }
+    }
+    if (indexBytes > 0) {
+        uint8_t* operand = &chunk->code[offset + 1 + slots];
+        int constant = indexBytes == 1 ? operand[0] : operand[0] | (operand[1] << 8) | (operand[2] << 16);
+        debugPrintf(" %d '", constant);
+        debugPrintValue(chunk->constants.values[constant]);
+        debugWrite("'", 1);
+    }
+    debugWrite("\n", 1);
+    return offset + 1 + slots + indexBytes;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
-    printf("%04d ", offset);
+    debugPrintf("%04d ", offset);
 
     // we show a | for any instruction that comes from the same source line as the preceding one
-    if (offset > 0 &&
-    chunk->lines[offset] == chunk->lines[offset - 1]) {
-        printf("   | ");
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
+        debugWrite("   | ", 5);
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        debugPrintf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -76,8 +193,66 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_PRINT", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_ADD_CONSTANT:
+            return constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+        case OP_SUBTRACT_CONSTANT:
+            return constantInstruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+        case OP_LESS_CONSTANT:
+            return constantInstruction("OP_LESS_CONSTANT", chunk, offset);
+        case OP_GREATER_CONSTANT:
+            return constantInstruction("OP_GREATER_CONSTANT", chunk, offset);
+        case OP_GET_GLOBAL_ADD:
+            return constantInstruction("OP_GET_GLOBAL_ADD", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_REG_LOAD_CONSTANT:
+            return registerInstruction("OP_REG_LOAD_CONSTANT", chunk, offset, 1, 1);
+        case OP_REG_LOAD_CONSTANT_LONG:
+            return registerInstruction("OP_REG_LOAD_CONSTANT_LONG", chunk, offset, 1, 3);
+        case OP_REG_GET_GLOBAL:
+            return registerInstruction("OP_REG_GET_GLOBAL", chunk, offset, 1, 1);
+        case OP_REG_GET_GLOBAL_LONG:
+            return registerInstruction("OP_REG_GET_GLOBAL_LONG", chunk, offset, 1, 3);
+        case OP_REG_DEFINE_GLOBAL:
+            return registerInstruction("OP_REG_DEFINE_GLOBAL", chunk, offset, 1, 1);
+        case OP_REG_DEFINE_GLOBAL_LONG:
+            return registerInstruction("OP_REG_DEFINE_GLOBAL_LONG", chunk, offset, 1, 3);
+        case OP_REG_SET_GLOBAL:
+            return registerInstruction("OP_REG_SET_GLOBAL", chunk, offset, 1, 1);
+        case OP_REG_SET_GLOBAL_LONG:
+            return registerInstruction("OP_REG_SET_GLOBAL_LONG", chunk, offset, 1, 3);
+        case OP_REG_EQUAL:
+            return registerInstruction("OP_REG_EQUAL", chunk, offset, 3, 0);
+        case OP_REG_GREATER:
+            return registerInstruction("OP_REG_GREATER", chunk, offset, 3, 0);
+        case OP_REG_LESS:
+            return registerInstruction("OP_REG_LESS", chunk, offset, 3, 0);
+        case OP_REG_ADD:
+            return registerInstruction("OP_REG_ADD", chunk, offset, 3, 0);
+        case OP_REG_SUBTRACT:
+            return registerInstruction("OP_REG_SUBTRACT", chunk, offset, 3, 0);
+        case OP_REG_MULTIPLY:
+            return registerInstruction("OP_REG_MULTIPLY", chunk, offset, 3, 0);
+        case OP_REG_DIVIDE:
+            return registerInstruction("OP_REG_DIVIDE", chunk, offset, 3, 0);
+        case OP_REG_ADD_GLOBAL:
+            return registerInstruction("OP_REG_ADD_GLOBAL", chunk, offset, 2, 1);
+        case OP_REG_NOT:
+            return registerInstruction("OP_REG_NOT", chunk, offset, 2, 0);
+        case OP_REG_NEGATE:
+            return registerInstruction("OP_REG_NEGATE", chunk, offset, 2, 0);
+        case OP_REG_PRINT:
+            return registerInstruction("OP_REG_PRINT", chunk, offset, 1, 0);
+        case OP_REG_RETURN:
+            return simpleInstruction("OP_REG_RETURN", offset);
         default:
-            printf("Unknown opcode %d\n", instruction);
+            debugPrintf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
@@ -6,4 +6,10 @@
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+// The disassembler and the execution trace print through a buffer that goes to stderr. See debug.c.
+void debugWrite(const char* chars, size_t length);
+void debugPrintf(const char* format, ...);
+void debugPrintValue(Value value);
+void flushDebugOutput();
+
 #endif
\ No newline at end of file
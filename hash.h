@@ -0,0 +1,117 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include <string.h>
+
+#include "common.h"
+
+// The string hash functions. Both are here, whichever one hashString() picks,
+// so that bench/hash_bench.c can compare them side by side.
+
+/**
+* The algorithm is called “FNV-1a”
+start with some initial hash value, usually a constant with certain carefully chosen mathematical properties.
+Then you walk the data to be hashed. For each byte (or sometimes word), you mix the bits into the hash value somehow,
+and then scramble the resulting bits around some.
+the basic goal is uniformity — we want the resulting hash values to be as widely scattered
+around the numeric range as possible to avoid collisions and clustering.
+ */
+static inline uint32_t hashFnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// FNV-1a has to finish one multiply before it can start on the next byte,
+// so it runs at about a byte every few cycles however long the string is.
+// This one, after wyhash, takes the string 16 bytes at a time.
+// Each step is a 64 x 64 -> 128-bit multiply with the two halves folded together, which mixes thoroughly.
+// Strings of up to 16 bytes, which covers nearly every identifier, are read as a few overlapping
+// loads from the two ends, so they don't loop at all.
+static const uint64_t hashSecret[3] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+};
+
+static inline uint64_t hashMix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t aHigh = a >> 32, aLow = (uint32_t)a;
+    uint64_t bHigh = b >> 32, bLow = (uint32_t)b;
+    uint64_t high = aHigh * bHigh, middle0 = aHigh * bLow, middle1 = aLow * bHigh, low = aLow * bLow;
+    uint64_t carry = ((low >> 32) + (uint32_t)middle0 + (uint32_t)middle1) >> 32;
+    uint64_t productLow = low + (middle0 << 32) + (middle1 << 32);
+    uint64_t productHigh = high + (middle0 >> 32) + (middle1 >> 32) + carry;
+    return productLow ^ productHigh;
+#endif
+}
+
+// memcpy() is how C spells an unaligned load; compilers turn these into single instructions.
+static inline uint64_t hashRead64(const char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hashRead32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// The full 64 bits, for when 32 aren't enough: cache.c uses it to tell whether a script has changed.
+static inline uint64_t hashWords64(const char* key, size_t length) {
+    const char* p = key;
+    size_t remaining = length;
+    uint64_t seed = hashMix(hashSecret[0], hashSecret[1]);
+    uint64_t a;
+    uint64_t b;
+
+    if (remaining <= 16) {
+        if (remaining >= 4) {
+            // Two pairs of 4-byte loads that between them cover every byte, overlapping in the middle.
+            size_t middle = (remaining >> 3) << 2;
+            a = (hashRead32(p) << 32) | hashRead32(p + middle);
+            b = (hashRead32(p + remaining - 4) << 32) | hashRead32(p + remaining - 4 - middle);
+        } else if (remaining > 0) {
+            a = ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[remaining >> 1] << 8) |
+                (uint8_t)p[remaining - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        while (remaining > 16) {
+            seed = hashMix(hashRead64(p) ^ hashSecret[1], hashRead64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes of the string, which may overlap bytes already mixed in.
+        a = hashRead64(p + remaining - 16);
+        b = hashRead64(p + remaining - 8);
+    }
+
+    return hashMix(hashSecret[2] ^ (uint64_t)length, hashMix(a ^ hashSecret[1], b ^ seed));
+}
+
+static inline uint32_t hashWords(const char* key, int length) {
+    uint64_t hash = hashWords64(key, (size_t)length);
+    // Tables only use the low bits for the bucket, and the Swiss table the top seven for its tags,
+    // so fold the high half in rather than just dropping it.
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static inline uint32_t hashString(const char* key, int length) {
+#ifdef WORD_HASH
+    return hashWords(key, length);
+#else
+    return hashFnv1a(key, length);
+#endif
+}
+
+#endif
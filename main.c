@@ -1,77 +1,223 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "batch.h"
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "output.h"
+#include "source.h"
 #include "vm.h"
 
-static void repl() {
-    char line[1024];
+// Adds the next line of stdin, however long it is, to the *length characters already in *buffer.
+// Returns false at the end of the input, if there was nothing left to read.
+static bool readLine(char** buffer, size_t* capacity, size_t* length) {
+    size_t start = *length;
     for (;;) {
-        printf("> ");
-
-        if (!fgets(line, sizeof(line), stdin)) {
-            printf("\n");
-            break;
+        if (*capacity - *length < 2) {
+            *capacity = *capacity < 1024 ? 1024 : *capacity * 2;
+            *buffer = (char*)realloc(*buffer, *capacity);
+            if (*buffer == NULL) exit(1);
         }
 
-        interpret(line);
+        size_t room = *capacity - *length;
+        if (room > INT_MAX) room = INT_MAX;
+        if (!fgets(*buffer + *length, (int)room, stdin)) break;
+        *length += strlen(*buffer + *length);
+        if ((*buffer)[*length - 1] == '\n') return true;
     }
+    return *length > start;
 }
 
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
+// With --lines, the REPL is for another program driving clox down a pipe rather than for a person:
+// there's no prompt, and each group of that many lines is compiled and run together, like a little script,
+// so an error only loses the rest of its own group. Errors give the line's number in the whole input.
+static void repl(int group) {
+    Session session;
+    initSession(&session);
+    char* buffer = NULL;
+    size_t capacity = 0;
+    int line = 1;
+    for (;;) {
+        if (group == 0) printf("> ");
+
+        size_t length = 0;
+        int count = 0;
+        while (count < (group == 0 ? 1 : group) && readLine(&buffer, &capacity, &length)) count++;
+        if (count == 0) {
+            if (group == 0) printf("\n");
+            break;
+        }
 
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        interpretSession(&session, buffer, length, group == 0 ? 1 : line);
+        line += count;
     }
 
-    // get the file size first for malloc
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file); // rewind to beginning of the file
+    free(buffer);
+    freeSession(&session);
+}
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+static void runFile(const char* path, bool stream) {
+    InterpretResult result;
+    if (stream) {
+        if (!streamSource(path, &result)) exit(74);
+    } else {
+        Source source;
+        if (!readSource(path, &source)) exit(74);
+        result = interpretSource(path, &source);
+        freeSource(&source);
     }
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
-    }
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
 
-    buffer[bytesRead] = '\0';
+#ifdef PROFILE_OPCODES
+// --profile and --profile-json count into this, and it's reported when clox exits, however it does.
+static Profile profile;
+static bool profileReport = false;
+static const char* profileJSONPath = NULL;
 
-    fclose(file);
-    return buffer;
+static void reportProfile() {
+    if (profileReport) printProfile(&profile, stderr);
+    if (profileJSONPath != NULL && !writeProfileJSON(&profile, profileJSONPath)) {
+        fprintf(stderr, "Could not write the profile to \"%s\".\n", profileJSONPath);
+    }
+    freeProfile(&profile);
 }
+#endif
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+// --stats is reported when clox exits, however it does, as long as the VM is still there.
+// After the VM has been freed, there's nothing more to report.
+static void reportStats() {
+    if (vm == NULL || !vm->printStats) return;
+    VMStats stats;
+    vmGetStats(vm, &stats);
+    // The script's last output is still in the VM's buffer, and has to come out before the report does.
+    flushOutput();
+    fflush(stdout);
+    printStats(&stats, stderr);
+}
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+static void usage() {
+    fprintf(stderr, "Usage: clox [--trace] [--dump] [--profile] [--profile-json file] [--sample n]\n"
+                    "            [--stats] [--registers] [--stream] [--jobs n] [--lines n] [path...]\n");
+    fprintf(stderr, "A path of - reads the script from stdin.\n");
+    fprintf(stderr, "--stream runs a script as it's read, a piece at a time, for ones too big to hold in memory.\n");
+    fprintf(stderr, "--lines runs the REPL without a prompt, compiling n lines of input at a time.\n");
+    fprintf(stderr, "--profile and --profile-json report the instructions run, by opcode, pair and line, at exit;\n"
+                    "--sample times one instruction in n as well.\n");
+    fprintf(stderr, "--stats reports the VM's memory, collector and hash table statistics at exit.\n");
+    fprintf(stderr, "--registers compiles to the experimental register-based instructions instead of the stack-based ones.\n");
+    exit(64);
+}
+
+// The debugging options only exist in builds that have the code for them (see CMakeLists.txt),
+// and asking for one that doesn't is an error rather than quietly running without it.
+#if !defined(DEBUG_TRACE_EXECUTION) || !defined(DEBUG_PRINT_CODE) || !defined(PROFILE_OPCODES)
+static void unavailable(const char* option, const char* build) {
+    fprintf(stderr, "%s needs %s of clox.\n", option, build);
+    exit(64);
 }
+#endif
 
 int main(int argc, const char* argv[]) {
     initVM();
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    // More than one script, a directory of them, or --jobs runs them all as a batch (see batch.c).
+    const char** paths = (const char**)malloc(sizeof(const char*) * argc);
+    int pathCount = 0;
+    int jobs = -1;
+    int group = 0;
+    int sampleInterval = 0;
+    bool stream = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0) {
+#ifdef DEBUG_TRACE_EXECUTION
+            vm->traceExecution = true;
+#else
+            unavailable(argv[i], "a Debug build");
+#endif
+        } else if (strcmp(argv[i], "--dump") == 0) {
+#ifdef DEBUG_PRINT_CODE
+            vm->printCode = true;
+#else
+            unavailable(argv[i], "a Debug build");
+#endif
+        } else if (strcmp(argv[i], "--profile") == 0 || strcmp(argv[i], "--profile-json") == 0 ||
+                   strcmp(argv[i], "--sample") == 0) {
+#ifdef PROFILE_OPCODES
+            if (strcmp(argv[i], "--profile") == 0) {
+                profileReport = true;
+            } else if (i + 1 == argc) {
+                usage();
+            } else if (strcmp(argv[i], "--profile-json") == 0) {
+                profileJSONPath = argv[++i];
+            } else {
+                char* end;
+                sampleInterval = (int)strtol(argv[++i], &end, 10);
+                if (*end != '\0' || sampleInterval < 1) usage();
+            }
+#else
+            unavailable(argv[i], "a CLOX_PROFILE build");
+#endif
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            vm->printStats = true;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            vm->codeFormat = FORMAT_REGISTER;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            char* end;
+            if (i + 1 == argc) usage();
+            jobs = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || jobs < 0) usage();
+        } else if (strcmp(argv[i], "--lines") == 0) {
+            char* end;
+            if (i + 1 == argc) usage();
+            group = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || group < 1) usage();
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage();
+        } else {
+            paths[pathCount++] = argv[i];
+        }
+    }
+
+    if (vm->printStats) atexit(reportStats);
+#ifdef PROFILE_OPCODES
+    if (sampleInterval != 0 && !profileReport && profileJSONPath == NULL) usage();
+    if (profileReport || profileJSONPath != NULL) {
+        initProfile(&profile, (uint32_t)sampleInterval);
+        vm->profile = &profile;
+        atexit(reportProfile);
+    }
+#else
+    (void)sampleInterval;
+#endif
+
+    int exitCode = 0;
+    if (pathCount == 0) {
+        if (jobs != -1 || stream) usage();
+        repl(group);
+    } else if (group != 0) {
+        usage();
+    } else if (pathCount == 1 && jobs == -1 && !isDirectory(paths[0])) {
+        runFile(paths[0], stream);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        if (stream) usage();
+#ifdef BATCH_RUNNER
+        exitCode = runBatch(paths, pathCount, jobs == -1 ? 0 : jobs);
+        vm->printStats = false; // the workers' VMs ran the scripts and have reported their own
+#else
+        fprintf(stderr, "This build of clox can only run one script at a time.\n");
+        exitCode = 64;
+#endif
     }
 
+    free(paths);
+    reportStats();
     freeVM();
-    return 0;
+    return exitCode;
 }
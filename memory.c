@@ -1,8 +1,20 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "compiler.h"
 #include "memory.h"
 #include "vm.h"
 
+// Everything the arenas and pools hand out is aligned this much, enough for any value we store.
+#define ALIGNMENT 16
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define POOL_BLOCK_SIZE (64 * 1024)
+
+static void collectForAllocation(size_t size);
+
 /**
  *
 oldSize	    newSize	              Operation
@@ -13,6 +25,12 @@ Non‑zero	Smaller than oldSize  Shrink existing allocation.
 Non‑zero	Larger than oldSize	  Grow existing allocation.
  */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (newSize > oldSize) {
+        vm->totalAllocated += newSize - oldSize;
+    } else {
+        vm->totalFreed += oldSize - newSize;
+    }
+
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -23,22 +41,536 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t capacity;
+    size_t used;
+};
+
+static inline uint8_t* arenaBlockData(ArenaBlock* block) {
+    return (uint8_t*)block + ALIGN(sizeof(ArenaBlock));
+}
+
+void initArena(Arena* arena) {
+    arena->blocks = NULL;
+    arena->stats.allocations = 0;
+    arena->stats.bytes = 0;
+    arena->stats.blocks = 0;
+}
+
+static void* arenaAllocate(Arena* arena, size_t size) {
+    size = ALIGN(size);
+    ArenaBlock* block = arena->blocks;
+    if (block == NULL || block->capacity - block->used < size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)reallocate(NULL, 0, ALIGN(sizeof(ArenaBlock)) + capacity);
+        block->capacity = capacity;
+        block->used = 0;
+
+        // An oversized block is full as soon as it's made,
+        // so it goes behind the current block rather than throwing away what's left of that.
+        if (size > ARENA_BLOCK_SIZE && arena->blocks != NULL) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+        arena->stats.blocks++;
+    }
+
+    void* result = arenaBlockData(block) + block->used;
+    block->used += size;
+    arena->stats.allocations++;
+    arena->stats.bytes += size;
+    return result;
+}
+
+// reallocate() for arena memory. Freeing does nothing, since the memory only comes back with freeArena().
+// Growing copies into a new allocation, except that the newest one can usually grow where it is.
+void* arenaReallocate(Arena* arena, void* pointer, size_t oldSize, size_t newSize) {
+    if (arena == NULL) return reallocate(pointer, oldSize, newSize);
+    if (newSize == 0) return NULL;
+
+    ArenaBlock* block = arena->blocks;
+    if (pointer != NULL &&
+        (uint8_t*)pointer + ALIGN(oldSize) == arenaBlockData(block) + block->used) {
+        size_t used = block->used - ALIGN(oldSize) + ALIGN(newSize);
+        if (used <= block->capacity) {
+            if (used > block->used) arena->stats.bytes += used - block->used;
+            block->used = used;
+            return pointer;
+        }
+    }
+
+    void* result = arenaAllocate(arena, newSize);
+    if (pointer != NULL) memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+}
+
+// Frees everything allocated from the arena, one block at a time. The counters keep their totals.
+void freeArena(Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        reallocate(block, ALIGN(sizeof(ArenaBlock)) + block->capacity, 0);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->stats.blocks = 0;
+}
+
+// A free slot holds the link to the next free slot of its size, so the free list costs no extra memory.
+struct PoolSlot {
+    PoolSlot* next;
+};
+
+struct PoolBlock {
+    PoolBlock* prev; // only used by large allocations
+    PoolBlock* next;
+};
+
+#define POOL_BLOCK_HEADER ALIGN(sizeof(PoolBlock))
+
+static const size_t poolSizes[POOL_CLASS_COUNT] = {16, 32, 48, 64, 96, 128, 192, POOL_MAX_SIZE};
+
+// sizeClasses[i] is the smallest class that holds i * ALIGNMENT bytes.
+static const uint8_t sizeClasses[POOL_MAX_SIZE / ALIGNMENT + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7,
+};
+
+static inline Pool* poolFor(size_t size) {
+    return &vm->heap.pools[sizeClasses[ALIGN(size) / ALIGNMENT]];
+}
+
+void initHeap(Heap* heap) {
+    memset(heap, 0, sizeof(Heap));
+}
+
+static void addPoolBlock(Pool* pool, size_t slotSize) {
+    PoolBlock* block = (PoolBlock*)reallocate(NULL, 0, POOL_BLOCK_SIZE);
+    block->prev = NULL;
+    block->next = pool->blocks;
+    pool->blocks = block;
+    pool->stats.blocks++;
+
+    // end is a whole number of slots from the start, so that the bump pointer lands on it exactly.
+    size_t slots = (POOL_BLOCK_SIZE - POOL_BLOCK_HEADER) / slotSize;
+    pool->next = (uint8_t*)block + POOL_BLOCK_HEADER;
+    pool->end = pool->next + slots * slotSize;
+}
+
+// Every object is allocated here, so this is where the collector is set off, by allocation pressure.
+// The new object isn't linked onto a list yet, so the collection can't free it out from under us.
+void* allocatePooled(size_t size) {
+    if (vm->bytesAllocated + size > vm->nextGC || vm->youngBytes + size > vm->nurserySize) {
+        collectForAllocation(size);
+    }
+    // Whatever is allocated while marking will be old.
+    if (vm->gcPhase != GC_MARKING) vm->youngBytes += size;
+
+    if (size > POOL_MAX_SIZE) {
+        Heap* heap = &vm->heap;
+        PoolBlock* block = (PoolBlock*)reallocate(NULL, 0, POOL_BLOCK_HEADER + size);
+        block->prev = NULL;
+        block->next = heap->large;
+        if (heap->large != NULL) heap->large->prev = block;
+        heap->large = block;
+
+        vm->bytesAllocated += size;
+        heap->largeStats.allocations++;
+        heap->largeStats.bytes += size;
+        heap->largeStats.blocks++;
+        return (uint8_t*)block + POOL_BLOCK_HEADER;
+    }
+
+    Pool* pool = poolFor(size);
+    vm->bytesAllocated += size;
+    pool->stats.allocations++;
+    pool->stats.bytes += size;
+
+    // Reuse a freed slot if there is one, and only then take a fresh one from the newest block.
+    if (pool->freeSlots != NULL) {
+        PoolSlot* slot = pool->freeSlots;
+        pool->freeSlots = slot->next;
+        return slot;
+    }
+
+    if (pool->next == pool->end) {
+        addPoolBlock(pool, poolSizes[pool - vm->heap.pools]);
+    }
+    void* slot = pool->next;
+    pool->next += poolSizes[pool - vm->heap.pools];
+    return slot;
+}
+
+// The size has to be the one the memory was allocated with, just like the oldSize passed to reallocate().
+void freePooled(void* pointer, size_t size) {
+    if (pointer == NULL) return;
+    vm->bytesAllocated -= size;
+
+    if (size > POOL_MAX_SIZE) {
+        Heap* heap = &vm->heap;
+        PoolBlock* block = (PoolBlock*)((uint8_t*)pointer - POOL_BLOCK_HEADER);
+        if (block->prev != NULL) {
+            block->prev->next = block->next;
+        } else {
+            heap->large = block->next;
+        }
+        if (block->next != NULL) block->next->prev = block->prev;
+        heap->largeStats.blocks--;
+        reallocate(block, POOL_BLOCK_HEADER + size, 0);
+        return;
+    }
+
+    Pool* pool = poolFor(size);
+    PoolSlot* slot = (PoolSlot*)pointer;
+    slot->next = pool->freeSlots;
+    pool->freeSlots = slot;
+}
+
+// Only freeObjects() frees blocks like this, once the VM is done with, so they aren't counted in vm->totalFreed.
+static void freeBlocks(PoolBlock* block) {
+    while (block != NULL) {
+        PoolBlock* next = block->next;
+        reallocate(block, 0, 0);
+        block = next;
+    }
+}
+
+// Every object lives in one of the heap's blocks, so freeing the blocks frees all of the objects
+// without visiting them one by one: the cost is in the number of blocks, not objects.
+void freeObjects() {
+    Heap* heap = &vm->heap;
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        Pool* pool = &heap->pools[i];
+        freeBlocks(pool->blocks);
+        pool->blocks = NULL;
+        pool->freeSlots = NULL;
+        pool->next = NULL;
+        pool->end = NULL;
+        pool->stats.blocks = 0;
+    }
+    freeBlocks(heap->large);
+    heap->large = NULL;
+    heap->largeStats.blocks = 0;
+
+    vm->objects = NULL;
+    vm->youngObjects = NULL;
+    vm->unswept = NULL;
+    vm->bytesAllocated = 0;
+    vm->youngBytes = 0;
+    vm->rememberedCount = 0;
+    vm->grayCount = 0;
+    vm->gcPhase = GC_IDLE;
+}
+
+// The collector is a tracing mark-sweep collector, as in the book, in two generations.
+// - Objects start out young, on vm->youngObjects. Most die young: a concatenation's result is
+//   printed and dropped. So every vm->nurserySize bytes a minor collection marks from the roots,
+//   stopping at old objects, frees the young objects it didn't reach and makes the rest old.
+//   That costs in the number of live young objects, however big the old heap has grown.
+// - Nothing is copied, young or old: C code all over the VM holds plain Obj* pointers that
+//   a moving collector would have to find and update. An object stays in its pool slot all its life,
+//   and becoming old is only unlinking it from one list and linking it onto vm->objects.
+// - Old objects are collected by a major collection, once vm->bytesAllocated passes vm->nextGC.
+//   It's incremental: the marking and then the sweeping are done a slice at a time,
+//   one slice per GC_SLICE_BYTES allocated, so the program never stops for the whole heap.
+// Marking starts from the roots: the stack, the globals, and the constants of the chunk being
+// run or compiled. Every object reached is marked and pushed on the gray stack. Popping an object
+// off marks whatever it refers to in turn, until nothing gray is left.
+// An object counts as marked when isMarked equals vm->markSense. Each major collection flips the sense,
+// which unmarks every old object at once, and the sweep never has to clear the survivors' flags.
+// vm->strings doesn't count as a root. It's a weak table: interning a string mustn't keep it alive
+// forever, so a string is deleted from it when the string is freed.
+
+// Stress mode makes the slices as small as they go, to give a missing barrier every chance to show.
+#ifdef DEBUG_STRESS_GC
+#define SLICE_BYTES 0
+#define MARK_SLICE 1
+#define SWEEP_SLICE 1
+#else
+#define SLICE_BYTES GC_SLICE_BYTES
+#define MARK_SLICE GC_MARK_SLICE
+#define SWEEP_SLICE GC_SWEEP_SLICE
+#endif
+
+static inline bool isMarked(Obj* object) {
+    return object->isMarked == vm->markSense;
+}
+
+// Puts a new object on the list it belongs on. The object must have been filled in,
+// since it's only now that a collection can see it.
+// While marking, new objects are old and already marked ("allocated black"):
+// the collection that's under way won't free them, and won't trace them either,
+// which is safe because the write barrier shades anything stored into them from then on.
+void linkObject(Obj* object) {
+    vm->liveObjects[object->type]++;
+    object->isRemembered = false;
+    if (vm->gcPhase == GC_MARKING) {
+        object->isYoung = false;
+        object->isMarked = vm->markSense;
+        object->next = vm->objects;
+        vm->objects = object;
+        return;
+    }
+    object->isYoung = true;
+    object->isMarked = !vm->markSense;
+    object->next = vm->youngObjects;
+    vm->youngObjects = object;
+}
+
+void markObject(Obj* object) {
+    if (object == NULL) return;
+    if (vm->gcMinor && !object->isYoung) return;
+    if (isMarked(object)) return;
+    object->isMarked = vm->markSense;
+
+    // The gray stack uses plain realloc(), so growing it never counts towards (or sets off) a collection.
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+        if (vm->grayStack == NULL) exit(1);
+    }
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(Value value) {
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+// There are two things an old object pointing at a new one can break:
+// a minor collection doesn't look inside old objects, so the young one would be freed;
+// and while a major collection is marking, an unmarked object stored into one that's already
+// been traced would never be found. So the barrier shades the object while marking,
+// and remembers it if it's young, keeping it alive until the next minor collection promotes it.
+// Remembering the stored object rather than where it was stored means the minor collection
+// doesn't need to know what kind of place that was: a table, a rope, anything.
+void writeBarrierSlow(Obj* object) {
+    if (vm->gcPhase == GC_MARKING) markObject(object);
+    if (!object->isYoung || object->isRemembered) return;
+
+    object->isRemembered = true;
+    if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+        vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+        vm->remembered = (Obj**)realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+        if (vm->remembered == NULL) exit(1);
+    }
+    vm->remembered[vm->rememberedCount++] = object;
+}
+
+static void markTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        markObject((Obj*)entry->key);
+        markValue(entry->value);
+    }
+}
+
+// The roots that are written without a barrier, which is every root but the globals.
+// The stack in particular is written by nearly every instruction, so rather than a barrier on each push,
+// the collector scans all of it (at most STACK_MAX slots) whenever it needs to.
+static void markUnbarrieredRoots() {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(*slot);
+    }
+
+    if (vm->chunk != NULL) {
+        ValueArray* constants = &vm->chunk->constants;
+        for (int i = 0; i < constants->count; i++) {
+            markValue(constants->values[i]);
+        }
+    }
+    markCompilerRoots();
+}
+
+static void blackenObject(Obj* object) {
+    switch (object->type) {
+        case OBJ_ROPE: {
+            // A flattened rope has let go of its pieces, and markObject() skips the NULLs.
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*)rope->flat);
+            break;
+        }
+        case OBJ_STRING:
+            break;
+    }
+}
+
+// Traces at most limit gray objects, and returns whether the gray stack has been emptied.
+static bool traceReferences(size_t limit) {
+    while (vm->grayCount > 0) {
+        if (limit-- == 0) return false;
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(object);
+    }
+    return true;
+}
+
 static void freeObject(Obj* object) {
+    vm->liveObjects[object->type]--;
     switch (object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            tableDelete(&vm->strings, string);
+            freePooled(object, stringSize(string->length));
             break;
         }
+        case OBJ_ROPE:
+            freePooled(object, sizeof(ObjRope));
+            break;
     }
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+static void minorCollection() {
+    vm->gcMinor = true;
+    markUnbarrieredRoots();
+    for (int i = 0; i < vm->rememberedCount; i++) {
+        markObject(vm->remembered[i]);
+    }
+    traceReferences(SIZE_MAX);
+    vm->gcMinor = false;
+
+    Obj* object = vm->youngObjects;
     while (object != NULL) {
         Obj* next = object->next;
-        freeObject(object);
+        if (isMarked(object)) {
+            object->isYoung = false;
+            object->isRemembered = false;
+            object->next = vm->objects;
+            vm->objects = object;
+            vm->gcStats.promoted++;
+        } else {
+            freeObject(object);
+        }
         object = next;
     }
-}
\ No newline at end of file
+
+    vm->youngObjects = NULL;
+    vm->youngBytes = 0;
+    vm->rememberedCount = 0;
+    vm->gcStats.minorCollections++;
+}
+
+// Empties the nursery first, so that while marking every object is old:
+// then the marking can ignore the nursery and the remembered set, and new objects can be allocated black.
+static void startMajor() {
+    minorCollection();
+    vm->markSense = !vm->markSense;
+    vm->gcPhase = GC_MARKING;
+    markUnbarrieredRoots();
+    markTable(&vm->globals);
+}
+
+// Since the roots were first marked, the program may have moved objects onto the stack
+// or into a chunk without a barrier, so those are marked again before the marking can be called done.
+// Everything that's on vm->objects now is about to be swept; anything allocated from here on
+// is young again, and isn't the sweep's business.
+static void finishMarking() {
+    markUnbarrieredRoots();
+    traceReferences(SIZE_MAX);
+    vm->unswept = vm->objects;
+    vm->objects = NULL;
+    vm->gcPhase = GC_SWEEPING;
+}
+
+static void finishMajor() {
+    vm->gcPhase = GC_IDLE;
+    vm->gcStats.majorCollections++;
+#ifdef DEBUG_STRESS_GC
+    // Collect again at the very next allocation, so that a missing root shows up
+    // as soon as possible after the code that forgot it.
+    vm->nextGC = 0;
+#else
+    vm->nextGC = (size_t)(vm->bytesAllocated * vm->gcGrowthFactor);
+    if (vm->nextGC < GC_INITIAL_THRESHOLD) vm->nextGC = GC_INITIAL_THRESHOLD;
+#endif
+}
+
+// Sweeps at most limit objects. The survivors move over to vm->objects as they're passed.
+static void sweepObjects(size_t limit) {
+    while (vm->unswept != NULL) {
+        if (limit-- == 0) return;
+        Obj* object = vm->unswept;
+        vm->unswept = object->next;
+        if (isMarked(object)) {
+            object->next = vm->objects;
+            vm->objects = object;
+        } else {
+            freeObject(object);
+        }
+    }
+    finishMajor();
+}
+
+static uint64_t nanoseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void recordPause(uint64_t start) {
+    uint64_t pause = nanoseconds() - start;
+    GCStats* stats = &vm->gcStats;
+    int bucket = 0;
+    for (uint64_t micros = pause / 1000; micros > 1 && bucket < GC_PAUSE_BUCKETS - 1; micros >>= 1) {
+        bucket++;
+    }
+    stats->pauses[bucket]++;
+    stats->pauseCount++;
+    stats->totalPause += pause;
+    if (pause > stats->maxPause) stats->maxPause = pause;
+}
+
+// Called by allocatePooled() when the nursery is full or the next slice of a major collection is due.
+static void collectForAllocation(size_t size) {
+    bool nurseryFull = vm->youngBytes + size > vm->nurserySize;
+    bool sliceDue = vm->bytesAllocated + size > vm->nextGC;
+    // While marking, nothing is young, so only a slice can be due.
+    if (vm->gcPhase == GC_MARKING && !sliceDue) return;
+
+    uint64_t start = nanoseconds();
+    switch (vm->gcPhase) {
+        case GC_IDLE:
+            if (sliceDue) {
+                startMajor();
+            } else {
+                minorCollection();
+            }
+            break;
+        case GC_MARKING:
+            if (traceReferences(MARK_SLICE)) finishMarking();
+            break;
+        case GC_SWEEPING:
+            if (nurseryFull) minorCollection();
+            if (sliceDue) sweepObjects(SWEEP_SLICE);
+            break;
+    }
+    if (vm->gcPhase != GC_IDLE) vm->nextGC = vm->bytesAllocated + SLICE_BYTES;
+    recordPause(start);
+}
+
+// Finishes the major collection under way, or does a whole one, without stopping.
+void collectGarbage() {
+    uint64_t start = nanoseconds();
+    if (vm->gcPhase == GC_IDLE) startMajor();
+    if (vm->gcPhase == GC_MARKING) finishMarking();
+    sweepObjects(SIZE_MAX);
+    recordPause(start);
+}
+
+void getGCStats(GCStats* stats) {
+    *stats = vm->gcStats;
+}
+
+void getMemoryStats(MemoryStats* stats) {
+    stats->arena = vm->arena.stats;
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        stats->pools[i] = vm->heap.pools[i].stats;
+        stats->poolSizes[i] = poolSizes[i];
+    }
+    stats->large = vm->heap.largeStats;
+}
@@ -10,6 +10,25 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// After a collection, the next one waits until the object heap has grown to this many times what survived.
+// Higher means fewer collections and more memory; vm->gcGrowthFactor can be changed at run time.
+#ifndef GC_HEAP_GROW_FACTOR
+#define GC_HEAP_GROW_FACTOR 2
+#endif
+// No collection happens before the objects take up this much.
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+
+// New objects start out young. Once this many bytes of them have been allocated,
+// a minor collection frees the dead ones and promotes the rest; vm->nurserySize can be changed at run time.
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+// A major collection is done in slices, one every this many bytes allocated,
+// each marking or sweeping this many objects.
+#define GC_SLICE_BYTES (16 * 1024)
+#define GC_MARK_SLICE 4096
+#define GC_SWEEP_SLICE 8192
+
 #define GROW_CAPACITY(capacity) \
 ((capacity) < 8 ? 8 : (capacity) * 2)
 
@@ -21,9 +40,112 @@ sizeof(type) * (newCount))
 #define FREE_ARRAY(type, pointer, oldCount) \
 reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// The same again for memory that may live in an arena. A NULL arena means the ordinary heap,
+// so code like the chunk doesn't have to care which one it was given.
+#define ARENA_ALLOCATE(arena, type, count) \
+(type*)arenaReallocate(arena, NULL, 0, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(arena, type, pointer, oldCount, newCount) \
+(type*)arenaReallocate(arena, pointer, sizeof(type) * (oldCount), \
+sizeof(type) * (newCount))
+
+#define ARENA_FREE_ARRAY(arena, type, pointer, oldCount) \
+arenaReallocate(arena, pointer, sizeof(type) * (oldCount), 0)
+
+// Objects come from the VM's pools instead of straight from malloc. See memory.c.
+#define ALLOCATE_POOLED(type, count) \
+(type*)allocatePooled(sizeof(type) * (count))
+
+#define FREE_POOLED(type, pointer, count) \
+freePooled(pointer, sizeof(type) * (count))
+
+// The counters kept by every arena and pool.
+// allocations and bytes only ever go up; blocks is how many blocks it holds from malloc right now.
+typedef struct {
+    size_t allocations;
+    size_t bytes;
+    size_t blocks;
+} AllocStats;
+
+typedef struct ArenaBlock ArenaBlock;
+
+// A bump allocator: memory is handed out by moving a pointer through a block,
+// and nothing is given back until the whole arena is freed at once.
+// That suits memory that all dies together, like everything one call to interpret() compiles.
+struct Arena {
+    ArenaBlock* blocks; // the block being filled, followed by the older, full ones
+    AllocStats stats;
+};
+
+// Objects are small and of only a handful of sizes, so each size class gets its own pool:
+// slots are carved out of large blocks and freed slots go on a free list for the next object.
+// Anything bigger than the largest class gets a block to itself.
+#define POOL_CLASS_COUNT 8
+#define POOL_MAX_SIZE 256
+
+typedef struct PoolSlot PoolSlot;
+typedef struct PoolBlock PoolBlock;
+
+typedef struct {
+    PoolSlot* freeSlots;
+    PoolBlock* blocks;
+    uint8_t* next; // the unused tail of the newest block
+    uint8_t* end;
+    AllocStats stats;
+} Pool;
+
+typedef struct {
+    Pool pools[POOL_CLASS_COUNT];
+    PoolBlock* large; // a doubly linked list, so that one large allocation can be freed on its own
+    AllocStats largeStats;
+} Heap;
+
+typedef struct {
+    AllocStats arena;                   // vm->arena, the per-interpret arena
+    AllocStats pools[POOL_CLASS_COUNT];
+    size_t poolSizes[POOL_CLASS_COUNT]; // the slot size of each pool
+    AllocStats large;
+} MemoryStats;
+
+typedef enum {
+    GC_IDLE,
+    GC_MARKING,  // a major collection is tracing the old objects, a slice at a time
+    GC_SWEEPING, // and is now freeing the ones it didn't reach
+} GCPhase;
+
+// Every stop the collector makes is timed and counted in a histogram:
+// bucket i counts the pauses of at least 2^i and less than 2^(i+1) microseconds, and bucket 0 everything shorter.
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct {
+    size_t minorCollections;
+    size_t majorCollections; // finished ones
+    size_t promoted;         // objects that survived the nursery
+    size_t pauseCount;
+    size_t pauses[GC_PAUSE_BUCKETS];
+    uint64_t maxPause;       // nanoseconds
+    uint64_t totalPause;
+} GCStats;
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+
+void initArena(Arena* arena);
+void* arenaReallocate(Arena* arena, void* pointer, size_t oldSize, size_t newSize);
+void freeArena(Arena* arena);
+
+void initHeap(Heap* heap);
+void* allocatePooled(size_t size);
+void freePooled(void* pointer, size_t size);
 void freeObjects();
 
+void linkObject(Obj* object);
+void markObject(Obj* object);
+void markValue(Value value);
+void writeBarrierSlow(Obj* object);
+void collectGarbage();
+
+void getMemoryStats(MemoryStats* stats);
+void getGCStats(GCStats* stats);
+
 
-#endif
\ No newline at end of file
+#endif
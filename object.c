@@ -1,96 +1,195 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-// this exists mainly to avoid the need to redundantly cast a void* back to the desired type
-#define ALLOCATE_OBJ(type, objectType) \
-(type*)allocateObject(sizeof(type), objectType)
-
 // The caller passes in the number of bytes
 // so that there is room for the extra payload fields needed by the specific object type being created.
+// The object isn't on a list yet: see linkObject() in memory.c.
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    Obj* object = (Obj*)allocatePooled(size);
     object->type = type;
-
-    object->next = vm.objects;
-    vm.objects = object;
     return object;
 }
 
-
 // It creates a new ObjString on the heap and then initializes its fields.
 // It’s sort of like a constructor in an OOP language
-static ObjString* allocateString(char* chars, int length,
-    uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+// The caller fills in the characters, and then either adds the string with internString()
+// or frees it with freePooled() if an equal string turns out to be interned already.
+static ObjString* allocateString(int length) {
+    ObjString* string = (ObjString*)allocateObject(stringSize(length), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-
-    // For clox, we’ll automatically intern every one
-    // That means whenever we create a new unique string, we add it to the table.
-    // We’re using the table more like a hash set than a hash table.
-    // The keys are the strings and those are all we care about,
-    // so we just use nil for the values.
-    tableSet(&vm.strings, string, NIL_VAL);
+    string->chars[length] = '\0';
+    return string;
+}
+
+// For clox, we’ll automatically intern every one
+// That means whenever we create a new unique string, we add it to the table.
+// We’re using the table more like a hash set than a hash table.
+// The keys are the strings and those are all we care about,
+// so we just use nil for the values.
+// findEntry() hashes the key, so the hash has to be filled in before this.
+static ObjString* internString(ObjString* string, uint32_t hash) {
     string->hash = hash;
+    linkObject((Obj*)string);
+    tableSet(&vm->strings, string, NIL_VAL);
     return string;
 }
 
-/**
-* The algorithm is called “FNV-1a”
-start with some initial hash value, usually a constant with certain carefully chosen mathematical properties.
-Then you walk the data to be hashed. For each byte (or sometimes word), you mix the bits into the hash value somehow,
-and then scramble the resulting bits around some.
-the basic goal is uniformity — we want the resulting hash values to be as widely scattered
-around the numeric range as possible to avoid collisions and clustering.
- */
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+// vm->strings is weak, so while a major collection is sweeping it can still hold strings the marking
+// didn't reach and the sweep hasn't freed yet. Finding one brings it back to life.
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+    if (interned != NULL && vm->gcPhase == GC_SWEEPING && !interned->obj.isYoung) {
+        interned->obj.isMarked = vm->markSense;
     }
-    return hash;
+    return interned;
 }
 
-ObjString* takeString(char* chars, int length) {
+// The lexeme points at a range of characters inside the monolithic source string and isn’t terminated,
+// so the characters are copied in after the header and terminated there.
+// If the string is already interned, nothing is allocated at all.
+ObjString* copyString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(chars, length, hash);
+    if (interned != NULL) return interned;
+
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return internString(string, hash);
+}
+
+// Hashes a string that has just been built and interns it,
+// unless an equal string is interned already, in which case the new one is freed and that one is returned.
+static ObjString* internBuiltString(ObjString* string) {
+    uint32_t hash = hashString(string->chars, string->length);
+    ObjString* interned = findInterned(string->chars, string->length, hash);
     if (interned != NULL) {
-        // Since ownership is being passed to this function and we no longer need the duplicate string,
-        // it’s up to us to free it.
-        FREE_ARRAY(char, chars, length + 1);
+        freePooled(string, stringSize(string->length));
         return interned;
     }
+    return internString(string, hash);
+}
 
-    return allocateString(chars, length, hash);
+// Used by constant folding at compile time, and by OP_ADD for short results.
+// The result is built straight into what will be the final object, so there's no separate buffer.
+// It takes an allocation to look the characters up, but if the string is interned already,
+// that allocation goes right back onto its pool's free list.
+ObjString* concatenateStrings(ObjString* a, ObjString* b) {
+    ObjString* string = allocateString(a->length + b->length);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+    return internBuiltString(string);
 }
 
+// Results shorter than this are still concatenated straight away:
+// copying that little costs less than a rope node does, and keeps short strings interned and cheap to compare.
+// So a rope is always at least this long, and anything shorter is a flat string.
+#define ROPE_MIN_LENGTH 64
 
-// We need to terminate the string ourselves because the lexeme points at
-// a range of characters inside the monolithic source string and isn’t terminated.
-ObjString* copyString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
+static inline int textLength(Obj* object) {
+    return object->type == OBJ_ROPE ? ((ObjRope*)object)->length : ((ObjString*)object)->length;
+}
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length,hash);
-    if (interned != NULL) return interned;
+// What OP_ADD does with two strings, either of which may be a rope.
+Obj* concatenateObjects(Obj* a, Obj* b) {
+    int length = textLength(a) + textLength(b);
+    if (length < ROPE_MIN_LENGTH) {
+        return (Obj*)concatenateStrings((ObjString*)a, (ObjString*)b);
+    }
 
-    char* heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    ObjRope* rope = (ObjRope*)allocateObject(sizeof(ObjRope), OBJ_ROPE);
+    rope->length = length;
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    linkObject((Obj*)rope);
+    // A rope allocated while a major collection is marking is old already, so its pieces need the barrier.
+    if (!rope->obj.isYoung) {
+        writeBarrier(OBJ_VAL(a));
+        writeBarrier(OBJ_VAL(b));
+    }
+    return (Obj*)rope;
+}
+
+// The rope has to be reachable from a root, on the VM's stack say,
+// since allocating the flat string can set off a collection.
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString* string = allocateString(rope->length);
+
+    // The pieces are copied in from the right end backwards, with an explicit stack instead of recursion.
+    // A left child is pushed before its right, so the right side is finished first,
+    // and for the ropes that `s = s + piece` builds, which lean all the way left,
+    // the stack never holds more than a couple of nodes however many pieces there are.
+    int capacity = 8;
+    int count = 0;
+    Obj** stack = ALLOCATE(Obj*, capacity);
+    stack[count++] = (Obj*)rope;
+    int end = rope->length;
+
+    while (count > 0) {
+        Obj* node = stack[--count];
+        if (node->type == OBJ_ROPE && ((ObjRope*)node)->flat != NULL) {
+            node = (Obj*)((ObjRope*)node)->flat;
+        }
+
+        if (node->type == OBJ_STRING) {
+            ObjString* piece = (ObjString*)node;
+            end -= piece->length;
+            memcpy(string->chars + end, piece->chars, piece->length);
+            continue;
+        }
+
+        if (count + 2 > capacity) {
+            int oldCapacity = capacity;
+            capacity = GROW_CAPACITY(oldCapacity);
+            stack = GROW_ARRAY(Obj*, stack, oldCapacity, capacity);
+        }
+        stack[count++] = ((ObjRope*)node)->left;
+        stack[count++] = ((ObjRope*)node)->right;
+    }
+    FREE_ARRAY(Obj*, stack, capacity);
+
+    // The flat string is all that's needed from now on, so the rope lets go of its pieces.
+    rope->flat = internBuiltString(string);
+    if (!rope->obj.isYoung) writeBarrier(OBJ_VAL(rope->flat));
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+static inline ObjString* flatten(Obj* object) {
+    return object->type == OBJ_ROPE ? flattenRope((ObjRope*)object) : (ObjString*)object;
+}
+
+// The slow path of objectsEqual(), for when at least one side is a rope.
+// Ropes of different lengths can't be equal, and finding that out doesn't need any flattening.
+bool ropesEqual(Obj* a, Obj* b) {
+    bool aIsText = a->type == OBJ_STRING || a->type == OBJ_ROPE;
+    bool bIsText = b->type == OBJ_STRING || b->type == OBJ_ROPE;
+    if (!aIsText || !bIsText) return false;
+    if (textLength(a) != textLength(b)) return false;
+    return flatten(a) == flatten(b);
 }
 
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            writeOutput(AS_CSTRING(value), (size_t)AS_STRING(value)->length);
+            break;
+        case OBJ_ROPE: {
+            ObjString* flat = flattenRope(AS_ROPE(value));
+            writeOutput(flat->chars, (size_t)flat->length);
             break;
+        }
     }
 }
\ No newline at end of file
@@ -7,33 +7,73 @@
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+// Either kind of string: what + concatenates and print shows as text.
+#define IS_TEXT(value)         (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
   } ObjType;
 
+// One more than the last type, for tables with an entry per type.
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
 struct Obj {
     ObjType type;
+    bool isMarked;     // reached by the collector when this equals vm->markSense; see memory.c
+    bool isYoung;      // still in the nursery, on vm->youngObjects
+    bool isRemembered; // young, and in vm->remembered because something old may point to it
     struct Obj* next;
 };
 
+// The characters are stored right after the header, in the same allocation,
+// so reaching them never means following a pointer to somewhere else.
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char chars[]; // length characters, then a terminating NUL
 };
 
-ObjString* takeString(char* chars, int length);
+// A string that is the concatenation of two others, not yet worked out.
+// Building one takes constant time, so `s = s + piece` over and over stays linear.
+// The characters are only copied out, hashed and interned when something needs the string itself:
+// printing it or comparing it. That happens once, since the result is kept in flat.
+typedef struct ObjRope {
+    Obj obj;
+    int length;
+    Obj* left;       // each a string or another rope, or NULL once flattened
+    Obj* right;
+    ObjString* flat; // the flattened, interned string, or NULL if nothing has needed it yet
+} ObjRope;
+
+// A string is a single allocation: the header, then the characters and their terminator.
+static inline size_t stringSize(int length) {
+    return sizeof(ObjString) + length + 1;
+}
+
 ObjString* copyString(const char* chars, int length);
+ObjString* concatenateStrings(ObjString* a, ObjString* b);
+Obj* concatenateObjects(Obj* a, Obj* b);
+ObjString* flattenRope(ObjRope* rope);
+bool ropesEqual(Obj* a, Obj* b);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Interned strings are equal exactly when they are the same object. Only ropes need a closer look.
+static inline bool objectsEqual(Obj* a, Obj* b) {
+    if (a == b) return true;
+    if (a->type != OBJ_ROPE && b->type != OBJ_ROPE) return false;
+    return ropesEqual(a, b);
+}
+
 
 #endif
\ No newline at end of file
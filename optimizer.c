@@ -0,0 +1,94 @@
+#include <string.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+// The peephole pass runs once over the finished chunk, from endCompiler().
+// Constant folding has already happened in the compiler by then;
+// this cleans up the patterns that only show up once whole statements are in place.
+//
+// It walks the code one instruction at a time,
+// copying each one down over the gap left by whatever has been removed before it,
+// and then tries its rewrites on the tail of the code kept so far.
+// Each kept instruction's line is noted as it goes, and the line table is rebuilt from those at the end,
+// so every instruction that survives keeps its line.
+// This only works because chunks have no jumps yet. Once they do,
+// removing code will also mean patching every jump that crosses it.
+
+// Instructions whose result is always true or false.
+static bool producesBool(uint8_t instruction) {
+    switch (instruction) {
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_LESS_CONSTANT:
+        case OP_GREATER_CONSTANT:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Instructions that push a value and do nothing else, and can't fail.
+static bool isPureLoad(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void optimizeChunk(Chunk* chunk) {
+    // starts[i] is the offset of the i-th kept instruction in the rewritten code, and lines[i] its line.
+    // The old line table is read through run, which only ever moves forward.
+    int originalCount = chunk->count;
+    int* starts = ARENA_ALLOCATE(chunk->arena, int, originalCount);
+    int* lines = ARENA_ALLOCATE(chunk->arena, int, originalCount);
+    int kept = 0;
+    int out = 0;
+    int run = 0;
+
+#define KEPT(distance) (chunk->code[starts[kept - 1 - (distance)]])
+    for (int in = 0; in < chunk->count;) {
+        while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= in) run++;
+        int length = instructionLength(chunk->code[in]);
+        memmove(&chunk->code[out], &chunk->code[in], length);
+        lines[kept] = chunk->lines[run].line;
+        starts[kept++] = out;
+        out += length;
+        in += length;
+
+        // Removing one pattern can expose another, so keep going until nothing matches.
+        for (;;) {
+            if (kept >= 3 && KEPT(0) == OP_NOT && KEPT(1) == OP_NOT &&
+                producesBool(KEPT(2))) {
+                // Negating a Boolean twice gives back the same Boolean.
+                // On anything else the pair converts to true or false, so it has to stay.
+                kept -= 2;
+            } else if (kept >= 2 && KEPT(0) == OP_POP && isPureLoad(KEPT(1))) {
+                // A value that is pushed only to be popped again, like the expression statement `1;`.
+                kept -= 2;
+            } else {
+                break;
+            }
+            out = starts[kept];
+        }
+    }
+#undef KEPT
+
+    chunk->count = out;
+    chunk->lineCount = 0;
+    for (int i = 0; i < kept; i++) {
+        addLine(chunk, starts[i], lines[i]);
+    }
+    ARENA_FREE_ARRAY(chunk->arena, int, lines, originalCount);
+    ARENA_FREE_ARRAY(chunk->arena, int, starts, originalCount);
+}
@@ -0,0 +1,171 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define HAVE_ISATTY
+#endif
+
+#include "output.h"
+#include "vm.h"
+
+static void writeStdout(const char* chars, size_t length, void* userData) {
+    (void)userData;
+    fwrite(chars, 1, length, stdout);
+}
+
+// Someone watching a terminal wants each line as soon as it's printed, and the
+// buffer would only hold them back; anywhere else, a pipe or a file, nobody sees
+// the output until runChunk() flushes the buffer after the program ends.
+void initOutput(Output* output) {
+    output->sink = writeStdout;
+    output->userData = NULL;
+#ifdef HAVE_ISATTY
+    output->buffered = !isatty(fileno(stdout));
+#else
+    output->buffered = true;
+#endif
+    output->count = 0;
+}
+
+// A caller that wants the output somewhere other than stdout, like a string or a log,
+// gets it in buffer-sized pieces from the sink.
+void setOutputSink(OutputSink sink, void* userData) {
+    flushOutput();
+    if (sink == NULL) {
+        initOutput(&vm->output);
+        return;
+    }
+    vm->output.sink = sink;
+    vm->output.userData = userData;
+    vm->output.buffered = true;
+}
+
+void writeOutput(const char* chars, size_t length) {
+    Output* output = &vm->output;
+    if (length > OUTPUT_BUFFER_SIZE - output->count) {
+        flushOutput();
+        // Anything as big as the buffer would only be copied in to be flushed straight out again.
+        if (length >= OUTPUT_BUFFER_SIZE) {
+            output->sink(chars, length, output->userData);
+            return;
+        }
+    }
+    memcpy(output->chars + output->count, chars, length);
+    output->count += length;
+}
+
+void endOutputLine() {
+    writeOutput("\n", 1);
+    if (!vm->output.buffered) flushOutput();
+}
+
+// Output going to stdout is through stdio's buffer too, so it's flushed from there as well,
+// for whatever a runtime error or a report is about to write to stderr to come after it.
+void flushOutput() {
+    Output* output = &vm->output;
+    if (output->count > 0) {
+        output->sink(output->chars, output->count, output->userData);
+        output->count = 0;
+    }
+    if (output->sink == writeStdout) fflush(stdout);
+}
+
+static char* writeInteger(char* out, uint32_t integer) {
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + integer % 10);
+        integer /= 10;
+    } while (integer != 0);
+    while (count > 0) *out++ = digits[--count];
+    return out;
+}
+
+// 10^-4 through 10^5: the decades %g prints without an exponent.
+// The nearest doubles to the negative powers are all a little above the true values,
+// so magnitude >= decades[i] is exactly the test of whether it's at least 10^(i - 4).
+static const double decades[] = {1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5};
+static const double powersOfTen[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+static const uint32_t powersOfFive[] = {1, 5, 25, 125, 625, 3125, 15625, 78125, 390625, 1953125};
+
+// Whether magnitude * 10^power is a double, so the multiplication gave exactly that.
+// Scaling by 10^power is multiplying the odd part of the mantissa by 5^power,
+// and the product is exact as long as that still fits in the 53 bits of a double's mantissa.
+static bool scalesExactly(double magnitude, int power) {
+    uint64_t bits;
+    memcpy(&bits, &magnitude, sizeof(bits));
+    uint64_t mantissa = (bits & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1 << 52);
+    while ((mantissa & 1) == 0) mantissa >>= 1;
+    return mantissa <= ((uint64_t)1 << 53) / powersOfFive[power];
+}
+
+// Writes number into buffer exactly as printf("%g") would, and returns the length.
+// Lox prints numbers with %g's six significant digits rather than the shortest round trip,
+// so there is no need for all of Ryu; this takes the approach of Grisu3 instead:
+// a fast path that works for nearly every number and knows when it can't be sure,
+// and then leaves the number to snprintf().
+int formatNumber(double number, char* buffer) {
+    char* out = buffer;
+    double magnitude = signbit(number) ? -number : number;
+
+    // Most numbers in a Lox program are integers, and small ones.
+    if (magnitude < 1e6 && magnitude == (double)(int32_t)magnitude) {
+        if (signbit(number)) *out++ = '-';
+        return (int)(writeInteger(out, (uint32_t)magnitude) - buffer);
+    }
+
+    if (magnitude >= 1e-4 && magnitude < 1e6) {
+        int exponent = 5;
+        while (magnitude < decades[exponent + 4]) exponent--;
+
+        // Scale the six significant digits up in front of the decimal point, and round off the rest.
+        // The multiplication can be off by half an ulp of scaled, about 6e-11 at this size,
+        // which only matters when the fraction is that close to a half, where it might decide
+        // which way to round. Unless the product is exact: then a half is a true tie,
+        // which printf() rounds to even, as it does 12500.25 to 12500.2.
+        int power = 5 - exponent;
+        double scaled = magnitude * powersOfTen[power];
+        uint32_t whole = (uint32_t)scaled;
+        double fraction = scaled - (double)whole;
+        bool tie = fraction == 0.5 && scalesExactly(magnitude, power);
+        if (tie || fraction < 0.5 - 1e-9 || fraction > 0.5 + 1e-9) {
+            uint32_t digits = whole + (tie ? (whole & 1) : (fraction > 0.5));
+            if (digits == 1000000) {
+                // Rounded up into the next decade, as 9.9999996 does to 10.
+                digits = 100000;
+                exponent++;
+            }
+            if (exponent < 6 && digits >= 100000) {
+                // %g drops the trailing zeros after the decimal point, but not those in front of it.
+                char text[10];
+                writeInteger(text, digits);
+                int significant = 6;
+                int integerDigits = exponent >= 0 ? exponent + 1 : 0;
+                while (significant > integerDigits && text[significant - 1] == '0') significant--;
+
+                if (signbit(number)) *out++ = '-';
+                if (exponent < 0) {
+                    *out++ = '0';
+                    *out++ = '.';
+                    for (int i = -1; i > exponent; i--) *out++ = '0';
+                    memcpy(out, text, significant);
+                    out += significant;
+                } else {
+                    memcpy(out, text, integerDigits);
+                    out += integerDigits;
+                    if (significant > integerDigits) {
+                        *out++ = '.';
+                        memcpy(out, text + integerDigits, significant - integerDigits);
+                        out += significant - integerDigits;
+                    }
+                }
+                return (int)(out - buffer);
+            }
+        }
+    }
+
+    // Exponents, infinities, NaNs, and the rare number the fast path can't round for certain.
+    return snprintf(buffer, NUMBER_BUFFER_SIZE, "%g", number);
+}
@@ -0,0 +1,34 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+
+// What print writes goes into a buffer owned by the VM and leaves it a buffer at a time,
+// instead of through a couple of locked stdio calls per line. See output.c.
+
+// Receives each full buffer, and whatever is left when the output is flushed.
+typedef void (*OutputSink)(const char* chars, size_t length, void* userData);
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Enough for anything formatNumber() writes, "%g" included.
+#define NUMBER_BUFFER_SIZE 32
+
+typedef struct {
+    OutputSink sink;
+    void* userData;
+    bool buffered; // false when the output is a terminal, so every line shows up as it's printed
+    size_t count;
+    char chars[OUTPUT_BUFFER_SIZE];
+} Output;
+
+void initOutput(Output* output);
+// NULL sends the output back to stdout.
+void setOutputSink(OutputSink sink, void* userData);
+void writeOutput(const char* chars, size_t length);
+void endOutputLine();
+void flushOutput();
+
+int formatNumber(double number, char* buffer);
+
+#endif
@@ -0,0 +1,261 @@
+#ifdef PROFILE_OPCODES
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "profile.h"
+
+// How many of the pairs and lines the report lists; the JSON has all of them.
+#define REPORT_TOP 20
+
+static const char* opNames[OP_COUNT] = {
+    [OP_NEGATE]             = "OP_NEGATE",
+    [OP_PRINT]              = "OP_PRINT",
+    [OP_CONSTANT]           = "OP_CONSTANT",
+    [OP_NIL]                = "OP_NIL",
+    [OP_TRUE]               = "OP_TRUE",
+    [OP_FALSE]              = "OP_FALSE",
+    [OP_POP]                = "OP_POP",
+    [OP_GET_GLOBAL]         = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL]      = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL]         = "OP_SET_GLOBAL",
+    [OP_EQUAL]              = "OP_EQUAL",
+    [OP_GREATER]            = "OP_GREATER",
+    [OP_LESS]               = "OP_LESS",
+    [OP_ADD]                = "OP_ADD",
+    [OP_SUBTRACT]           = "OP_SUBTRACT",
+    [OP_MULTIPLY]           = "OP_MULTIPLY",
+    [OP_DIVIDE]             = "OP_DIVIDE",
+    [OP_NOT]                = "OP_NOT",
+    [OP_RETURN]             = "OP_RETURN",
+    [OP_ADD_CONSTANT]       = "OP_ADD_CONSTANT",
+    [OP_SUBTRACT_CONSTANT]  = "OP_SUBTRACT_CONSTANT",
+    [OP_LESS_CONSTANT]      = "OP_LESS_CONSTANT",
+    [OP_GREATER_CONSTANT]   = "OP_GREATER_CONSTANT",
+    [OP_GET_GLOBAL_ADD]     = "OP_GET_GLOBAL_ADD",
+    [OP_CONSTANT_LONG]      = "OP_CONSTANT_LONG",
+    [OP_GET_GLOBAL_LONG]    = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG]    = "OP_SET_GLOBAL_LONG",
+    [OP_REG_LOAD_CONSTANT]      = "OP_REG_LOAD_CONSTANT",
+    [OP_REG_LOAD_CONSTANT_LONG] = "OP_REG_LOAD_CONSTANT_LONG",
+    [OP_REG_GET_GLOBAL]         = "OP_REG_GET_GLOBAL",
+    [OP_REG_GET_GLOBAL_LONG]    = "OP_REG_GET_GLOBAL_LONG",
+    [OP_REG_DEFINE_GLOBAL]      = "OP_REG_DEFINE_GLOBAL",
+    [OP_REG_DEFINE_GLOBAL_LONG] = "OP_REG_DEFINE_GLOBAL_LONG",
+    [OP_REG_SET_GLOBAL]         = "OP_REG_SET_GLOBAL",
+    [OP_REG_SET_GLOBAL_LONG]    = "OP_REG_SET_GLOBAL_LONG",
+    [OP_REG_EQUAL]              = "OP_REG_EQUAL",
+    [OP_REG_GREATER]            = "OP_REG_GREATER",
+    [OP_REG_LESS]               = "OP_REG_LESS",
+    [OP_REG_ADD]                = "OP_REG_ADD",
+    [OP_REG_SUBTRACT]           = "OP_REG_SUBTRACT",
+    [OP_REG_MULTIPLY]           = "OP_REG_MULTIPLY",
+    [OP_REG_DIVIDE]             = "OP_REG_DIVIDE",
+    [OP_REG_ADD_GLOBAL]         = "OP_REG_ADD_GLOBAL",
+    [OP_REG_NOT]                = "OP_REG_NOT",
+    [OP_REG_NEGATE]             = "OP_REG_NEGATE",
+    [OP_REG_PRINT]              = "OP_REG_PRINT",
+    [OP_REG_RETURN]             = "OP_REG_RETURN",
+};
+
+void initProfile(Profile* profile, uint32_t sampleInterval) {
+    memset(profile, 0, sizeof(*profile));
+    profile->sampleInterval = sampleInterval;
+    profile->countdown = sampleInterval;
+    profileStart(profile);
+}
+
+void freeProfile(Profile* profile) {
+    free(profile->lines);
+    profile->lines = NULL;
+    profile->lineCapacity = 0;
+}
+
+// The lines array is the profiler's own, from malloc rather than reallocate(),
+// so that profiling doesn't move the collector's thresholds.
+void growProfileLines(Profile* profile, int line) {
+    int capacity = profile->lineCapacity < 256 ? 256 : profile->lineCapacity;
+    while (capacity <= line) capacity *= 2;
+    profile->lines = (uint64_t*)realloc(profile->lines, sizeof(uint64_t) * capacity);
+    if (profile->lines == NULL) exit(1);
+    memset(profile->lines + profile->lineCapacity, 0, sizeof(uint64_t) * (capacity - profile->lineCapacity));
+    profile->lineCapacity = capacity;
+}
+
+uint64_t profileClock() {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+#endif
+}
+
+// For a batch, where each worker's VM profiles into a Profile of its own until it's done.
+void mergeProfile(Profile* into, const Profile* from) {
+    for (int a = 0; a < OP_COUNT; a++) {
+        into->ops[a] += from->ops[a];
+        into->samples[a] += from->samples[a];
+        into->cycles[a] += from->cycles[a];
+        for (int b = 0; b < OP_COUNT; b++) into->pairs[a][b] += from->pairs[a][b];
+    }
+    if (from->lineCapacity > into->lineCapacity) growProfileLines(into, from->lineCapacity - 1);
+    for (int line = 0; line < from->lineCapacity; line++) into->lines[line] += from->lines[line];
+}
+
+// A count with what it counts: an opcode, a pair of them as first * OP_COUNT + second, or a line.
+typedef struct {
+    int key;
+    uint64_t count;
+} Entry;
+
+typedef struct {
+    Entry* entries;
+    int count;
+} Ranking;
+
+static int compareEntries(const void* a, const void* b) {
+    const Entry* left = (const Entry*)a;
+    const Entry* right = (const Entry*)b;
+    if (left->count != right->count) return left->count < right->count ? 1 : -1;
+    return left->key - right->key;
+}
+
+// The nonzero counts, most first, or only the first limit of them.
+// A script of a million lines has a million line counts, and sorting them all
+// would take longer than profiling the script did, so the top few are picked out as they go by.
+static Ranking rank(const uint64_t* counts, int length, int limit) {
+    Ranking ranking;
+    ranking.entries = (Entry*)malloc(sizeof(Entry) * (length > 0 ? length : 1));
+    if (ranking.entries == NULL) exit(1);
+    ranking.count = 0;
+    for (int i = 0; i < length; i++) {
+        if (counts[i] == 0) continue;
+        Entry entry = {i, counts[i]};
+        if (limit >= length) {
+            ranking.entries[ranking.count++] = entry;
+            continue;
+        }
+
+        if (ranking.count == limit) {
+            if (compareEntries(&entry, &ranking.entries[limit - 1]) >= 0) continue;
+            ranking.count--;
+        }
+        int slot = ranking.count++;
+        while (slot > 0 && compareEntries(&entry, &ranking.entries[slot - 1]) < 0) {
+            ranking.entries[slot] = ranking.entries[slot - 1];
+            slot--;
+        }
+        ranking.entries[slot] = entry;
+    }
+    if (limit >= length) qsort(ranking.entries, ranking.count, sizeof(Entry), compareEntries);
+    return ranking;
+}
+
+static uint64_t totalInstructions(const Profile* profile) {
+    uint64_t total = 0;
+    for (int op = 0; op < OP_COUNT; op++) total += profile->ops[op];
+    return total;
+}
+
+static double percent(uint64_t count, uint64_t total) {
+    return total == 0 ? 0.0 : 100.0 * (double)count / (double)total;
+}
+
+#ifdef HAVE_RDTSC
+#define CLOCK_UNIT "cycles"
+#else
+#define CLOCK_UNIT "ns"
+#endif
+
+void printProfile(const Profile* profile, FILE* out) {
+    uint64_t total = totalInstructions(profile);
+    fprintf(out, "== profile: %llu instructions ==\n", (unsigned long long)total);
+
+    Ranking ops = rank(profile->ops, OP_COUNT, OP_COUNT);
+    fprintf(out, "%-26s %14s %7s", "opcode", "count", "%");
+    if (profile->sampleInterval != 0) fprintf(out, " %10s %10s", "samples", CLOCK_UNIT "/op");
+    fprintf(out, "\n");
+    for (int i = 0; i < ops.count; i++) {
+        int op = ops.entries[i].key;
+        fprintf(out, "%-26s %14llu %6.2f%%", opNames[op], (unsigned long long)ops.entries[i].count,
+                percent(ops.entries[i].count, total));
+        if (profile->sampleInterval != 0 && profile->samples[op] != 0) {
+            fprintf(out, " %10llu %10.1f", (unsigned long long)profile->samples[op],
+                    (double)profile->cycles[op] / (double)profile->samples[op]);
+        }
+        fprintf(out, "\n");
+    }
+    free(ops.entries);
+
+    Ranking pairs = rank(&profile->pairs[0][0], OP_COUNT * OP_COUNT, REPORT_TOP);
+    fprintf(out, "\n%-52s %14s %7s\n", "opcode pair", "count", "%");
+    for (int i = 0; i < pairs.count; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s %s",
+                 opNames[pairs.entries[i].key / OP_COUNT], opNames[pairs.entries[i].key % OP_COUNT]);
+        fprintf(out, "%-52s %14llu %6.2f%%\n", name, (unsigned long long)pairs.entries[i].count,
+                percent(pairs.entries[i].count, total));
+    }
+    free(pairs.entries);
+
+    Ranking lines = rank(profile->lines, profile->lineCapacity, REPORT_TOP);
+    fprintf(out, "\n%-26s %14s %7s\n", "line", "count", "%");
+    for (int i = 0; i < lines.count; i++) {
+        fprintf(out, "%-26d %14llu %6.2f%%\n", lines.entries[i].key, (unsigned long long)lines.entries[i].count,
+                percent(lines.entries[i].count, total));
+    }
+    free(lines.entries);
+}
+
+// The same as printProfile(), in full, sorted the same way:
+// {"instructions": n, "clock": "cycles" or "ns", "sampleInterval": n,
+//  "opcodes": [{"op", "count", "samples", "clock"}...], "pairs": [{"first", "second", "count"}...],
+//  "lines": [{"line", "count"}...]}
+bool writeProfileJSON(const Profile* profile, const char* path) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) return false;
+
+    fprintf(out, "{\"instructions\": %llu, \"clock\": \"%s\", \"sampleInterval\": %u,\n",
+            (unsigned long long)totalInstructions(profile), CLOCK_UNIT, profile->sampleInterval);
+
+    Ranking ops = rank(profile->ops, OP_COUNT, OP_COUNT);
+    fprintf(out, " \"opcodes\": [");
+    for (int i = 0; i < ops.count; i++) {
+        int op = ops.entries[i].key;
+        fprintf(out, "%s\n  {\"op\": \"%s\", \"count\": %llu, \"samples\": %llu, \"clock\": %llu}",
+                i == 0 ? "" : ",", opNames[op], (unsigned long long)ops.entries[i].count,
+                (unsigned long long)profile->samples[op], (unsigned long long)profile->cycles[op]);
+    }
+    free(ops.entries);
+
+    Ranking pairs = rank(&profile->pairs[0][0], OP_COUNT * OP_COUNT, OP_COUNT * OP_COUNT);
+    fprintf(out, "],\n \"pairs\": [");
+    for (int i = 0; i < pairs.count; i++) {
+        fprintf(out, "%s\n  {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}", i == 0 ? "" : ",",
+                opNames[pairs.entries[i].key / OP_COUNT], opNames[pairs.entries[i].key % OP_COUNT],
+                (unsigned long long)pairs.entries[i].count);
+    }
+    free(pairs.entries);
+
+    Ranking lines = rank(profile->lines, profile->lineCapacity, profile->lineCapacity);
+    fprintf(out, "],\n \"lines\": [");
+    for (int i = 0; i < lines.count; i++) {
+        fprintf(out, "%s\n  {\"line\": %d, \"count\": %llu}", i == 0 ? "" : ",",
+                lines.entries[i].key, (unsigned long long)lines.entries[i].count);
+    }
+    free(lines.entries);
+    fprintf(out, "]}\n");
+
+    return fclose(out) == 0;
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+// The opcode profiler, for finding out where run() spends its time without paying for DEBUG_TRACE_EXECUTION.
+// It counts the instructions executed by opcode, by pair of consecutive opcodes, which is what picks
+// the superinstructions worth adding, and by source line. It can also time one instruction in every few
+// to see what each opcode costs. Only builds with PROFILE_OPCODES (CLOX_PROFILE in CMake) have any of it;
+// everywhere else, the hook in run() is ((void)0) and this header declares nothing.
+
+#ifdef PROFILE_OPCODES
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+typedef struct {
+    uint64_t ops[OP_COUNT];
+    uint64_t pairs[OP_COUNT][OP_COUNT]; // pairs[a][b] counts the times b ran right after a
+    uint64_t* lines;                    // lines[n] counts the instructions run from line n
+    int lineCapacity;
+
+    // Where run() is up to: the last opcode, or -1 at the start of a chunk,
+    // and the run of the chunk's line table that the last instruction was in.
+    int previous;
+    int lineRun;
+
+    // Cycle sampling: every sampleInterval-th instruction is timed from its dispatch to the next one.
+    // 0 turns it off. The time is the CPU's timestamp counter where there is one, or else nanoseconds.
+    uint32_t sampleInterval;
+    uint32_t countdown;
+    int sampled; // the opcode being timed, or -1
+    uint64_t sampleStart;
+    uint64_t samples[OP_COUNT];
+    uint64_t cycles[OP_COUNT];
+} Profile;
+
+void initProfile(Profile* profile, uint32_t sampleInterval);
+void freeProfile(Profile* profile);
+void mergeProfile(Profile* into, const Profile* from);
+void printProfile(const Profile* profile, FILE* out);
+bool writeProfileJSON(const Profile* profile, const char* path);
+
+uint64_t profileClock();
+void growProfileLines(Profile* profile, int line);
+
+// Called by run() before it starts on a chunk.
+static inline void profileStart(Profile* profile) {
+    profile->previous = -1;
+    profile->lineRun = 0;
+    profile->sampled = -1;
+}
+
+// Called by run() with ip at each instruction, just before it's dispatched.
+static inline void profileInstruction(Profile* profile, const Chunk* chunk, const uint8_t* ip) {
+    if (profile->sampled >= 0) {
+        profile->cycles[profile->sampled] += profileClock() - profile->sampleStart;
+        profile->samples[profile->sampled]++;
+        profile->sampled = -1;
+    }
+
+    uint8_t op = *ip;
+    profile->ops[op]++;
+    if (profile->previous >= 0) profile->pairs[profile->previous][op]++;
+    profile->previous = op;
+
+    // Nothing jumps, so the instructions go through the line table in order
+    // and finding the line is a matter of moving on to the next run now and again.
+    if (chunk->lineCount > 0) {
+        int offset = (int)(ip - chunk->code);
+        int run = profile->lineRun;
+        while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= offset) run++;
+        profile->lineRun = run;
+        int line = chunk->lines[run].line;
+        if (line >= profile->lineCapacity) growProfileLines(profile, line);
+        profile->lines[line]++;
+    }
+
+    if (profile->sampleInterval != 0 && --profile->countdown == 0) {
+        profile->countdown = profile->sampleInterval;
+        profile->sampled = op;
+        profile->sampleStart = profileClock();
+    }
+}
+
+#endif
+
+#endif
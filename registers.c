@@ -0,0 +1,224 @@
+#include "memory.h"
+#include "registers.h"
+
+// The register code generator runs over the finished stack code, from endCompiler(),
+// after the peephole pass, so it gets the folded constants and the fused instructions for free.
+//
+// Since nothing jumps, the depth of the stack before every instruction is known while compiling,
+// and the value the stack VM would keep at depth i goes in register i. The generator walks the stack code
+// keeping track of where each of the values the stack would hold actually is: a register,
+// or a slot of the frame's literals and constants. Loading a constant or a literal emits nothing,
+// it's just noted as where that value is, and the instruction that uses it reads it from there.
+// OP_POP likewise emits nothing. What's left are the instructions that do something.
+//
+// Each register instruction gets the line of the stack instruction it comes from.
+// Code deeper than REGISTER_MAX is left as it is, in FORMAT_STACK, which the VM still runs.
+
+typedef struct {
+    Chunk out;
+    uint8_t slots[REGISTER_MAX]; // slots[i] is the frame slot of the value the stack would have at depth i
+    int depth;
+    int registerCount;
+    int line;
+    bool overflowed;
+} Generator;
+
+static void emit(Generator* generator, uint8_t byte) {
+    writeChunk(&generator->out, byte, generator->line);
+}
+
+static void emitIndex(Generator* generator, int index) {
+    emit(generator, (uint8_t)(index & 0xff));
+    emit(generator, (uint8_t)((index >> 8) & 0xff));
+    emit(generator, (uint8_t)((index >> 16) & 0xff));
+}
+
+// Emits an instruction with a slot operand and a constant index, in its long form if the index needs it.
+static void emitIndexed(Generator* generator, OpCode op, OpCode longOp, uint8_t slot, int index) {
+    emit(generator, index <= UINT8_MAX ? op : longOp);
+    emit(generator, slot);
+    if (index <= UINT8_MAX) {
+        emit(generator, (uint8_t)index);
+    } else {
+        emitIndex(generator, index);
+    }
+}
+
+// The register at the top of the stack, for an instruction to put its result in.
+static uint8_t target(Generator* generator) {
+    int reg = generator->depth;
+    if (reg == REGISTER_MAX) {
+        generator->overflowed = true;
+        return 0;
+    }
+    if (reg + 1 > generator->registerCount) generator->registerCount = reg + 1;
+    return (uint8_t)reg;
+}
+
+static void push(Generator* generator, uint8_t slot) {
+    if (generator->depth == REGISTER_MAX) {
+        generator->overflowed = true;
+        return;
+    }
+    generator->slots[generator->depth++] = slot;
+}
+
+static uint8_t pop(Generator* generator) {
+    return generator->slots[--generator->depth];
+}
+
+static void pushConstant(Generator* generator, int index) {
+    if (index < FRAME_CONSTANT_COUNT) {
+        push(generator, (uint8_t)(FRAME_CONSTANTS + index));
+        return;
+    }
+    uint8_t reg = target(generator);
+    emitIndexed(generator, OP_REG_LOAD_CONSTANT, OP_REG_LOAD_CONSTANT_LONG, reg, index);
+    push(generator, reg);
+}
+
+static void binary(Generator* generator, OpCode op) {
+    uint8_t b = pop(generator);
+    uint8_t a = pop(generator);
+    uint8_t reg = target(generator);
+    emit(generator, op);
+    emit(generator, reg);
+    emit(generator, a);
+    emit(generator, b);
+    push(generator, reg);
+}
+
+static void unary(Generator* generator, OpCode op) {
+    uint8_t a = pop(generator);
+    uint8_t reg = target(generator);
+    emit(generator, op);
+    emit(generator, reg);
+    emit(generator, a);
+    push(generator, reg);
+}
+
+// Translates chunk's stack code into register code in place. The constants stay as they are.
+// Returns false, leaving the chunk alone, if the code needs more than REGISTER_MAX registers.
+bool generateRegisterCode(Chunk* chunk) {
+    Generator generator;
+    initChunk(&generator.out, chunk->arena);
+    generator.depth = 0;
+    generator.registerCount = 0;
+    generator.overflowed = false;
+
+    uint8_t* code = chunk->code;
+    int run = 0;
+// The constant operand of the instruction at offset, in its short or its long form.
+#define INDEX() (code[offset + 1])
+#define LONG_INDEX() (code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16))
+#define EITHER_INDEX(shortOp) (instruction == (shortOp) ? INDEX() : LONG_INDEX())
+    for (int offset = 0; offset < chunk->count && !generator.overflowed;) {
+        while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= offset) run++;
+        generator.line = chunk->lines[run].line;
+
+        uint8_t instruction = code[offset];
+
+        switch (instruction) {
+            case OP_CONSTANT:      pushConstant(&generator, INDEX()); offset += 2; break;
+            case OP_CONSTANT_LONG: pushConstant(&generator, LONG_INDEX()); offset += 4; break;
+            case OP_NIL:   push(&generator, FRAME_NIL); offset++; break;
+            case OP_TRUE:  push(&generator, FRAME_TRUE); offset++; break;
+            case OP_FALSE: push(&generator, FRAME_FALSE); offset++; break;
+            case OP_POP:   pop(&generator); offset++; break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG: {
+                uint8_t reg = target(&generator);
+                emitIndexed(&generator, OP_REG_GET_GLOBAL, OP_REG_GET_GLOBAL_LONG, reg,
+                            EITHER_INDEX(OP_GET_GLOBAL));
+                push(&generator, reg);
+                offset += instruction == OP_GET_GLOBAL ? 2 : 4;
+                break;
+            }
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG:
+                emitIndexed(&generator, OP_REG_DEFINE_GLOBAL, OP_REG_DEFINE_GLOBAL_LONG, pop(&generator),
+                            EITHER_INDEX(OP_DEFINE_GLOBAL));
+                offset += instruction == OP_DEFINE_GLOBAL ? 2 : 4;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+                // An assignment is an expression, so its value stays where it is for whatever uses it next.
+                emitIndexed(&generator, OP_REG_SET_GLOBAL, OP_REG_SET_GLOBAL_LONG,
+                            generator.slots[generator.depth - 1],
+                            EITHER_INDEX(OP_SET_GLOBAL));
+                offset += instruction == OP_SET_GLOBAL ? 2 : 4;
+                break;
+            case OP_EQUAL:    binary(&generator, OP_REG_EQUAL); offset++; break;
+            case OP_GREATER:  binary(&generator, OP_REG_GREATER); offset++; break;
+            case OP_LESS:     binary(&generator, OP_REG_LESS); offset++; break;
+            case OP_ADD:      binary(&generator, OP_REG_ADD); offset++; break;
+            case OP_SUBTRACT: binary(&generator, OP_REG_SUBTRACT); offset++; break;
+            case OP_MULTIPLY: binary(&generator, OP_REG_MULTIPLY); offset++; break;
+            case OP_DIVIDE:   binary(&generator, OP_REG_DIVIDE); offset++; break;
+            // The constant operand of a fused instruction is an operand like any other.
+            case OP_ADD_CONSTANT:
+                pushConstant(&generator, INDEX());
+                binary(&generator, OP_REG_ADD);
+                offset += 2;
+                break;
+            case OP_SUBTRACT_CONSTANT:
+                pushConstant(&generator, INDEX());
+                binary(&generator, OP_REG_SUBTRACT);
+                offset += 2;
+                break;
+            case OP_LESS_CONSTANT:
+                pushConstant(&generator, INDEX());
+                binary(&generator, OP_REG_LESS);
+                offset += 2;
+                break;
+            case OP_GREATER_CONSTANT:
+                pushConstant(&generator, INDEX());
+                binary(&generator, OP_REG_GREATER);
+                offset += 2;
+                break;
+            case OP_GET_GLOBAL_ADD: {
+                uint8_t a = pop(&generator);
+                uint8_t reg = target(&generator);
+                emit(&generator, OP_REG_ADD_GLOBAL);
+                emit(&generator, reg);
+                emit(&generator, a);
+                emit(&generator, INDEX());
+                push(&generator, reg);
+                offset += 2;
+                break;
+            }
+            case OP_NOT:    unary(&generator, OP_REG_NOT); offset++; break;
+            case OP_NEGATE: unary(&generator, OP_REG_NEGATE); offset++; break;
+            case OP_PRINT:
+                emit(&generator, OP_REG_PRINT);
+                emit(&generator, pop(&generator));
+                offset++;
+                break;
+            case OP_RETURN: emit(&generator, OP_REG_RETURN); offset++; break;
+            default:
+                // Register code going through again, or something that isn't code at all.
+                generator.overflowed = true;
+                break;
+        }
+    }
+#undef INDEX
+#undef LONG_INDEX
+#undef EITHER_INDEX
+
+    if (generator.overflowed) {
+        freeChunk(&generator.out);
+        return false;
+    }
+
+    ARENA_FREE_ARRAY(chunk->arena, uint8_t, chunk->code, chunk->capacity);
+    ARENA_FREE_ARRAY(chunk->arena, LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->code = generator.out.code;
+    chunk->count = generator.out.count;
+    chunk->capacity = generator.out.capacity;
+    chunk->lines = generator.out.lines;
+    chunk->lineCount = generator.out.lineCount;
+    chunk->lineCapacity = generator.out.lineCapacity;
+    chunk->format = FORMAT_REGISTER;
+    chunk->registerCount = generator.registerCount;
+    return true;
+}
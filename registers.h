@@ -0,0 +1,28 @@
+#ifndef clox_registers_h
+#define clox_registers_h
+
+#include "chunk.h"
+
+// The register-based instruction set, an experimental alternative to the stack-based one.
+// Instead of pushing its operands and popping them again, an instruction names the frame slots
+// they're in and the register its result goes to, so `a = b + 1;` is a load of b,
+// an add of it and the 1 and a store to a, with no constant to push and nothing to pop.
+//
+// The frame is vm->stack, laid out as
+//   [0, REGISTER_MAX)                       the registers
+//   FRAME_NIL, FRAME_TRUE, FRAME_FALSE      the literals
+//   [FRAME_CONSTANTS, STACK_MAX)            the chunk's first FRAME_CONSTANT_COUNT constants
+// with the literals and constants copied in before the chunk runs. That makes a constant operand
+// just another slot, and reading an operand a single load whichever kind it is.
+// Constants past the ones in the frame are loaded into a register by OP_REG_LOAD_CONSTANT.
+#define REGISTER_MAX 128
+#define FRAME_NIL REGISTER_MAX
+#define FRAME_TRUE (REGISTER_MAX + 1)
+#define FRAME_FALSE (REGISTER_MAX + 2)
+#define FRAME_CONSTANTS (REGISTER_MAX + 3)
+#define FRAME_CONSTANT_COUNT (FRAME_SIZE - FRAME_CONSTANTS)
+#define FRAME_SIZE 256
+
+bool generateRegisterCode(Chunk* chunk);
+
+#endif
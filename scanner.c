@@ -4,30 +4,98 @@
 #include "common.h"
 #include "scanner.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define SCANNER_SSE2
+#endif
+
 typedef struct {
     const char* start; // The start pointer marks the beginning of the current lexeme being scanned
     const char* current; // The current points to the current character being looked at.
     int line; // to track what line the current lexeme is on for error reporting.
 } Scanner;
 
-Scanner scanner;
+static THREAD_LOCAL Scanner scanner;
 
 
 void initScanner(const char* source) {
+    initScannerAt(source, 1);
+}
+
+// For a source that comes a piece at a time, where a piece starts part way through.
+void initScannerAt(const char* source, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
 }
 
+// How far the scanner has read: the end of the last token it returned, or of the whitespace after it.
+const char* scannerPosition() {
+    return scanner.current;
+}
+
+// The class of every byte, so telling letters, digits and spaces apart takes one load instead of a run of compares.
+// '\n' isn't a space here, since skipping it also means counting a line.
+enum {
+    CHAR_SPACE = 1,
+    CHAR_ALPHA = 2, // and '_'
+    CHAR_DIGIT = 4,
+};
+
+#define S CHAR_SPACE
+#define A CHAR_ALPHA
+#define D CHAR_DIGIT
+static const uint8_t charClasses[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, S, 0, 0, 0, S, 0, 0, // \t \r
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // space
+    D, D, D, D, D, D, D, D, D, D, 0, 0, 0, 0, 0, 0, // 0-9
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, // A-O
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, A, // P-Z _
+    0, A, A, A, A, A, A, A, A, A, A, A, A, A, A, A, // a-o
+    A, A, A, A, A, A, A, A, A, A, A, 0, 0, 0, 0, 0, // p-z
+};
+#undef S
+#undef A
+#undef D
+
 static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') ||
-           (c >= 'A' && c <= 'Z') ||
-            c == '_';
+    return charClasses[(uint8_t)c] & CHAR_ALPHA;
 }
 
 static bool isDigit(char c) {
-    return c >= '0' && c <= '9';
+    return charClasses[(uint8_t)c] & CHAR_DIGIT;
+}
+
+// Returns where the first stop, '\n' or '\0' is, from p on.
+// Comments and string literals can go on for a long way, so their insides are searched 16 bytes at a time.
+// The loads are aligned, and an aligned load never reaches into the next page,
+// so reading past the '\0' at the end of the source is safe: it's only AddressSanitizer that has to be told.
+#ifdef SCANNER_SSE2
+__attribute__((no_sanitize_address))
+static const char* findStop(const char* p, char stop) {
+    while (((uintptr_t)p & 15) != 0) {
+        if (*p == stop || *p == '\n' || *p == '\0') return p;
+        p++;
+    }
+
+    const __m128i stops = _mm_set1_epi8(stop);
+    const __m128i newlines = _mm_set1_epi8('\n');
+    const __m128i zeros = _mm_setzero_si128();
+    for (;; p += 16) {
+        __m128i bytes = _mm_load_si128((const __m128i*)p);
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(bytes, stops),
+                                     _mm_or_si128(_mm_cmpeq_epi8(bytes, newlines), _mm_cmpeq_epi8(bytes, zeros)));
+        int mask = _mm_movemask_epi8(found);
+        if (mask != 0) return p + __builtin_ctz((unsigned)mask);
+    }
+}
+#else
+static const char* findStop(const char* p, char stop) {
+    while (*p != stop && *p != '\n' && *p != '\0') p++;
+    return p;
 }
+#endif
 
 // We require the source string to be a good null-terminated C string
 static bool isAtEnd() {
@@ -79,13 +147,12 @@ static Token errorToken(const char* message) {
 
 static void skipWhitespace() {
     for (;;) {
+        const char* current = scanner.current;
+        while (charClasses[(uint8_t)*current] & CHAR_SPACE) current++;
+        scanner.current = current;
+
         char c = peek();
         switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance();
-                break;
             case '\n':
                 scanner.line++;
                 advance();
@@ -93,7 +160,7 @@ static void skipWhitespace() {
             case '/':
                 if (peekNext() == '/') {
                     // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                    scanner.current = findStop(scanner.current + 2, '\n');
                 } else {
                     return;
                 }
@@ -104,55 +171,50 @@ static void skipWhitespace() {
     }
 }
 
-static TokenType checkKeyword(int start, int length,
-    const char* rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-        }
-
-    return TOKEN_IDENTIFIER;
-}
+// The keywords by a perfect hash: (first letter + 5 * last letter + length) % 32 is different for each of them,
+// so an identifier can only be the keyword in its own bucket, and one memcmp() says whether it is.
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[32] = {
+    [2] = {"else", 4, TOKEN_ELSE},
+    [3] = {"for", 3, TOKEN_FOR},
+    [4] = {"false", 5, TOKEN_FALSE},
+    [7] = {"class", 5, TOKEN_CLASS},
+    [9] = {"if", 2, TOKEN_IF},
+    [11] = {"or", 2, TOKEN_OR},
+    [13] = {"nil", 3, TOKEN_NIL},
+    [15] = {"fun", 3, TOKEN_FUN},
+    [17] = {"true", 4, TOKEN_TRUE},
+    [18] = {"super", 5, TOKEN_SUPER},
+    [19] = {"var", 3, TOKEN_VAR},
+    [21] = {"while", 5, TOKEN_WHILE},
+    [23] = {"this", 4, TOKEN_THIS},
+    [24] = {"and", 3, TOKEN_AND},
+    [25] = {"print", 5, TOKEN_PRINT},
+    [30] = {"return", 6, TOKEN_RETURN},
+};
 
 static TokenType identifierType() {
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            // Before we switch, we need to check that there even is a second letter.
-            // “f” by itself is a valid identifier too, after all.
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+    int length = (int)(scanner.current - scanner.start);
+    if (length < 2 || length > 6) return TOKEN_IDENTIFIER;
+
+    uint8_t first = (uint8_t)scanner.start[0];
+    uint8_t last = (uint8_t)scanner.start[length - 1];
+    const Keyword* keyword = &keywords[(first + 5 * last + length) & 31];
+    if (keyword->length == length && memcmp(scanner.start, keyword->name, length) == 0) {
+        return keyword->type;
     }
-
     return TOKEN_IDENTIFIER;
 }
 
 static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
+    const char* current = scanner.current;
+    while (charClasses[(uint8_t)*current] & (CHAR_ALPHA | CHAR_DIGIT)) current++;
+    scanner.current = current;
     return makeToken(identifierType());
 }
 
@@ -171,8 +233,10 @@ static Token number() {
 }
 
 static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
+    for (;;) {
+        scanner.current = findStop(scanner.current, '"');
+        if (peek() != '\n') break;
+        scanner.line++;
         advance();
     }
 
@@ -33,6 +33,8 @@ typedef struct {
 
 
 void initScanner(const char* source);
+void initScannerAt(const char* source, int line);
+const char* scannerPosition();
 Token scanToken();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+#include "cache.h"
+#include "source.h"
+
+#ifndef S_ISDIR
+#define S_ISDIR(mode) (((mode) & S_IFMT) == S_IFDIR)
+#endif
+
+// Reads file to the end, for anything there's no mapping of: pipes, stdin, and systems without mmap.
+// The size isn't known up front for a pipe, so the buffer grows as it fills.
+static bool readAll(FILE* file, const char* path, Source* source) {
+    size_t capacity = 64 * 1024;
+    size_t length = 0;
+    char* buffer = (char*)malloc(capacity);
+    for (;;) {
+        if (buffer == NULL) {
+            fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+            return false;
+        }
+        length += fread(buffer + length, sizeof(char), capacity - length, file);
+        if (length < capacity) break;
+        capacity *= 2;
+        char* grown = (char*)realloc(buffer, capacity);
+        if (grown == NULL) free(buffer);
+        buffer = grown;
+    }
+
+    if (ferror(file)) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        return false;
+    }
+
+    buffer[length] = '\0';
+    source->chars = buffer;
+    source->length = length;
+    source->mapped = false;
+    return true;
+}
+
+// A script mapped into memory is scanned where it lies, with no copy of it made at all,
+// which is most of the time it takes to start on a script of a hundred megabytes.
+// The scanner needs a '\0' after the last character, and a mapping gives it one for free:
+// the rest of the file's last page reads as zeros. A file that exactly fills its last page has no such rest,
+// so it's read instead, as is an empty one, which can't be mapped.
+// A mapped file that's cut short while it runs would crash clox, as it would any program that maps files.
+#ifdef HAVE_MMAP
+static bool mapFile(FILE* file, Source* source) {
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0) return false;
+    size_t size = (size_t)info.st_size;
+    if (size % (size_t)sysconf(_SC_PAGESIZE) == 0) return false;
+
+    void* base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (base == MAP_FAILED) return false;
+    // The scanner goes through it once from front to back.
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    source->chars = (const char*)base;
+    source->length = size;
+    source->mapped = true;
+    return true;
+}
+#endif
+
+bool readSource(const char* path, Source* source) {
+    bool fromStdin = strcmp(path, "-") == 0;
+    FILE* file = fromStdin ? stdin : fopen(path, "rb");
+
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    bool read = false;
+#ifdef HAVE_MMAP
+    read = mapFile(file, source);
+#endif
+    if (!read) read = readAll(file, path, source);
+
+    if (!fromStdin) fclose(file);
+    return read;
+}
+
+void freeSource(Source* source) {
+#ifdef HAVE_MMAP
+    if (source->mapped) {
+        munmap((void*)source->chars, source->length);
+        return;
+    }
+#endif
+    free((void*)source->chars);
+}
+
+static size_t readPiece(char* buffer, size_t size, void* userData) {
+    return fread(buffer, sizeof(char), size, (FILE*)userData);
+}
+
+bool streamSource(const char* path, InterpretResult* result) {
+    bool fromStdin = strcmp(path, "-") == 0;
+    FILE* file = fromStdin ? stdin : fopen(path, "rb");
+
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    *result = interpretStream(readPiece, file);
+    bool read = !ferror(file);
+    if (!read) fprintf(stderr, "Could not read file \"%s\".\n", path);
+
+    if (!fromStdin) fclose(file);
+    return read;
+}
+
+bool isDirectory(const char* path) {
+    struct stat info;
+    return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+InterpretResult interpretSource(const char* path, const Source* source) {
+#ifdef BYTECODE_CACHE
+    // Scripts that are run over and over without changing spend most of their time in the front end,
+    // so the compiled chunk is kept next to the script, as foo.loxc for foo.lox.
+    // A chunk loaded from the cache isn't compiled, so --dump would have nothing to show,
+    // and a script from stdin has nowhere to keep one.
+    bool cached = !vm->printCode && strcmp(path, "-") != 0;
+    char* cachePath = cached ? cachePathFor(path) : NULL;
+    InterpretResult result = cachePath != NULL ? interpretCached(source->chars, source->length, cachePath)
+                                               : interpret(source->chars);
+    free(cachePath);
+    return result;
+#else
+    (void)path;
+    return interpret(source->chars);
+#endif
+}
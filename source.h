@@ -0,0 +1,29 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+#include "common.h"
+#include "vm.h"
+
+// A script's text, ending in a '\0' the scanner can stop at.
+// A regular file is mapped into memory rather than copied, where mapping is available; see source.c.
+typedef struct {
+    const char* chars;
+    size_t length;
+    bool mapped; // or read into memory from the heap
+} Source;
+
+// Reads the script at path, or from stdin for "-".
+// If it can't, it says why on stderr and returns false.
+bool readSource(const char* path, Source* source);
+void freeSource(Source* source);
+
+// Runs the script at path, or from stdin for "-", as it's read, with interpretStream().
+// Returns false if it couldn't be read.
+bool streamSource(const char* path, InterpretResult* result);
+
+bool isDirectory(const char* path);
+
+// Runs the script read from path on the current VM, using its bytecode cache in builds that have one.
+InterpretResult interpretSource(const char* path, const Source* source);
+
+#endif
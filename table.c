@@ -7,12 +7,24 @@
 #include "value.h"
 
 #define TABLE_MAX_LOAD 0.75
+// Below this load, deletion shrinks the table to half its size.
+// It's well under half of TABLE_MAX_LOAD, so a table hovering around one size doesn't keep resizing back and forth.
+#define TABLE_MIN_LOAD 0.25
+#define TABLE_MIN_CAPACITY 8
+
+// A table's capacity is always a power of two: it starts at zero, grows through GROW_CAPACITY,
+// which goes 8, 16, 32 and so on, and shrinks by halving, never below TABLE_MIN_CAPACITY.
+// That lets a probe wrap around with a bitmask instead of an integer division: hash & (capacity - 1)
+// is the same bucket as hash % capacity, but costs a single AND instead of tens of cycles on the hot path.
 
 
 void initTable(Table* table) {
     table->count = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->resizes = 0;
+    table->stringLookups = 0;
+    table->stringHits = 0;
 }
 
 void freeTable(Table* table) {
@@ -23,32 +35,23 @@ void freeTable(Table* table) {
 static Entry* findEntry(Entry* entries, int capacity,
                         ObjString* key) {
 
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = key->hash & mask;
 
     for (;;) {
         Entry* entry = &entries[index];
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // if we have passed a tombstone, we return its bucket instead of the later empty one.
-                // If we’re calling findEntry() in order to insert a node,
-                // that lets us treat the tombstone bucket as empty and reuse it for the new entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone. save entry to tombstone (can return later) and keep going
-                // (we use a NULL key and a true value to represent tombstone)
-                if (tombstone == NULL) tombstone = entry;
-            }
-            // it uses == to compare, this is pointer equality
-            // 這個 == 比較的是 a 和 b 是否指向同一塊記憶體
-            // we intern string so any string is guaranteed to be textually distinct from all others.
-            // so that each sequence of characters is represented by only one string in memory
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
-        }
-        index = (index + 1) % capacity;
+        // Deletion shifts entries back instead of leaving tombstones (see tableDelete()),
+        // so the first empty bucket really does end the probe sequence,
+        // and it's also where an insert of this key belongs.
+
+        // it uses == to compare, this is pointer equality
+        // 這個 == 比較的是 a 和 b 是否指向同一塊記憶體
+        // we intern string so any string is guaranteed to be textually distinct from all others.
+        // so that each sequence of characters is represented by only one string in memory
+        if (entry->key == NULL || entry->key == key) return entry;
+
+        index = (index + 1) & mask;
     }
 }
 
@@ -62,6 +65,18 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
+// Returns the index in table->entries of the bucket holding key, or -1 if it isn't in the table.
+// The index stays valid only until the table is resized or a key is deleted (which can shift other keys back),
+// so callers that keep it around must check entries[index].key before trusting it.
+int tableFindSlot(Table* table, ObjString* key) {
+    if (table->count == 0) return -1;
+
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return -1;
+
+    return (int)(entry - table->entries);
+}
+
 static void adjustCapacity(Table* table, int capacity) {
     Entry* entries = ALLOCATE(Entry, capacity);
     for (int i = 0; i < capacity; i++) {
@@ -77,11 +92,7 @@ static void adjustCapacity(Table* table, int capacity) {
      * So the simplest way to get every entry where it belongs is to rebuild the table
      * from scratch by re-inserting every entry into the new empty array.
      *
-     * for: table->count = 0
-     * When we resize the array, we allocate a new array and re-insert all of the existing entries into it.
-     * During that process, we don’t copy the tombstones over.
-     * They don’t add any value since we’re rebuilding the probe sequences anyway, and would just slow down lookups.
-     * That means we need to recalculate the count since it may change during a resize
+     * That is also how a table shrinks: the same rebuild into a smaller array.
      */
     table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
@@ -91,12 +102,13 @@ static void adjustCapacity(Table* table, int capacity) {
         Entry* dest = findEntry(entries, capacity, entry->key);
         dest->key = entry->key;
         dest->value = entry->value;
-        table->count++; // Then each time we find a non-tombstone entry, we increment it.
+        table->count++;
     }
 
     FREE_ARRAY(Entry, table->entries, table->capacity);
     table->entries = entries;
     table->capacity = capacity;
+    table->resizes++;
 }
 
 
@@ -109,11 +121,7 @@ bool tableSet(Table* table, ObjString* key, Value value) {
     Entry* entry = findEntry(table->entries, table->capacity, key);
     bool isNewKey = entry->key == NULL;
 
-    // since we run the risk of ending up with no actual empty buckets to terminate a lookup
-    // we don’t reduce the count when deleting an entry in the delete code.
-    // so the count is no longer the number of entries in the hash table, it’s the number of entries plus tombstones.
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
-
+    // With no tombstones, count is exactly the number of keys in the table.
     if (isNewKey) table->count++;
 
     entry->key = key;
@@ -121,6 +129,45 @@ bool tableSet(Table* table, ObjString* key, Value value) {
     return isNewKey;
 }
 
+// Empties the bucket at index and repairs the probe sequences that ran through it.
+//
+// Leaving a tombstone would keep those sequences intact, but tombstones are never reclaimed until the next resize,
+// and a long-lived table that keeps deleting and adding keys ends up mostly tombstones: slow to probe and never shrinking.
+// Instead, this is backward-shift deletion. It walks the entries after the hole, up to the next empty bucket.
+// Any entry whose home bucket (its hash & mask) is not cyclically between the hole and itself
+// could legally sit in the hole, so it moves back into it, and the bucket it left becomes the new hole.
+// When the walk stops, no probe sequence has an empty bucket in the middle of it.
+static void removeEntry(Table* table, uint32_t index) {
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    Entry* entries = table->entries;
+    uint32_t hole = index;
+
+    for (uint32_t next = (hole + 1) & mask; entries[next].key != NULL;
+         next = (next + 1) & mask) {
+        uint32_t home = entries[next].key->hash & mask;
+
+        // How far the entry has been displaced from its home, and how far it is from the hole.
+        // If it's displaced at least as far as the hole is behind it, the hole is on its probe sequence.
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            entries[hole] = entries[next];
+            hole = next;
+        }
+    }
+
+    entries[hole].key = NULL;
+    entries[hole].value = NIL_VAL;
+    table->count--;
+}
+
+// A table that has emptied out gives its memory back, halving until it's at least a quarter full.
+static void shrinkToFit(Table* table) {
+    int capacity = table->capacity;
+    while (capacity > TABLE_MIN_CAPACITY && table->count < capacity * TABLE_MIN_LOAD) {
+        capacity /= 2;
+    }
+    if (capacity != table->capacity) adjustCapacity(table, capacity);
+}
+
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
@@ -128,12 +175,8 @@ bool tableDelete(Table* table, ObjString* key) {
     Entry* entry = findEntry(table->entries, table->capacity, key);
     if (entry->key == NULL) return false;
 
-    // We replace the entry with a tombstone.
-    // In clox, we use a NULL key and a true value to represent that,
-    // but any representation that can’t be confused
-    // with an empty bucket or a valid entry works.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    removeEntry(table, (uint32_t)(entry - table->entries));
+    shrinkToFit(table);
     return true;
 }
 
@@ -154,24 +197,53 @@ void tableAddAll(Table* from, Table* to) {
  */
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
+    table->stringLookups++;
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    uint32_t index = hash & mask;
 
     for (;;) {
 
         Entry* entry = &table->entries[index];
 
         if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
+            // Stop if we find an empty entry.
+            return NULL;
         } else if (entry->key->length == length &&
             entry->key->hash == hash &&
             memcmp(entry->key->chars, chars, length) == 0) {
             // We found it.
+            table->stringHits++;
             return entry->key;
             }
 
-        index = (index + 1) % table->capacity;
+        index = (index + 1) & mask;
+    }
+}
+
+void tableGetStats(Table* table, TableStats* stats) {
+    stats->count = table->count;
+    stats->capacity = table->capacity;
+    stats->displaced = 0;
+    stats->maxProbe = 0;
+    stats->meanProbe = 0;
+    stats->tombstones = 0;
+    stats->resizes = table->resizes;
+    stats->stringLookups = table->stringLookups;
+    stats->stringHits = table->stringHits;
+
+    uint32_t mask = (uint32_t)table->capacity - 1;
+    long total = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        ObjString* key = table->entries[i].key;
+        if (key == NULL) continue;
+
+        // Probes only move forward, so the distance back to the home bucket is the probe length.
+        int probe = (int)(((uint32_t)i - (key->hash & mask)) & mask) + 1;
+        if (probe > 1) stats->displaced++;
+        if (probe > stats->maxProbe) stats->maxProbe = probe;
+        total += probe;
     }
+    if (table->count > 0) stats->meanProbe = (double)total / table->count;
 }
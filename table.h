@@ -9,19 +9,49 @@ typedef struct {
     Value value;
 } Entry;
 
+// There are two implementations of this interface, chosen at build time (CLOX_TABLE_BACKEND):
+// table.c, open addressing with linear probing, and table_swiss.c, a Swiss table (TABLE_SWISS).
+// Either way entries is a plain array of buckets, and a bucket that doesn't hold a key has a NULL key,
+// so code outside the table can walk entries directly.
 typedef struct {
-    int count;
-    int capacity;
+    int count;    // the number of keys in the table
+    int capacity; // the number of buckets, always a power of two
     Entry* entries;
+#ifdef TABLE_SWISS
+    // One control byte per bucket: empty, deleted, or the top seven bits of the key's hash.
+    uint8_t* control;
+    int tombstones; // buckets marked deleted, which still lengthen probes until the next rebuild
+#endif
+    // Counted as the table is used, for tableGetStats(). initTable() starts them over.
+    int resizes;          // rebuilds by adjustCapacity(), to grow, to shrink, or to clear out tombstones
+    size_t stringLookups; // calls to tableFindString(), which is how vm.strings interns
+    size_t stringHits;    // the ones that found the string already there
 } Table;
 
+// How well the keys are spread, for benchmarks and tuning.
+// A key's probe length is how many places a lookup of it looks at, counting the first:
+// buckets in table.c, 16-bucket groups in table_swiss.c.
+typedef struct {
+    int count;
+    int capacity;
+    int displaced;     // keys that aren't in the first place their probe looks
+    int maxProbe;
+    double meanProbe;  // 1.0 when every key is where its hash first points
+    int tombstones;    // always 0 in table.c, which deletes without them
+    int resizes;
+    size_t stringLookups;
+    size_t stringHits;
+} TableStats;
+
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+int tableFindSlot(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash);
+void tableGetStats(Table* table, TableStats* stats);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SWISS_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SWISS_NEON
+#endif
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+// A Swiss table keeps a separate array of one-byte control words next to the buckets.
+// A full bucket's control byte holds seven bits of its key's hash (H2),
+// so a probe can rule out almost every non-matching bucket without touching its Entry.
+// Buckets are probed a group of 16 at a time: one SIMD compare matches H2 against all 16 control bytes,
+// and only the buckets whose byte matched have their keys compared.
+// A group with an empty bucket in it ends the probe, because an insert would have stopped there.
+//
+// The probe sequence visits whole groups, stepping by 1, 2, 3, ... groups (triangular numbers).
+// With a power-of-two number of groups that reaches every group, so a probe always terminates
+// as long as the table keeps some empty buckets, which the load limit guarantees.
+
+#define GROUP_WIDTH 16
+// Keys and tombstones together never fill more than this much of the table.
+#define TABLE_MAX_LOAD 0.875
+// Below this load of live keys, deletion shrinks the table to half its size.
+#define TABLE_MIN_LOAD 0.25
+
+#define CONTROL_EMPTY   ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+
+// H1 picks the first group from the low bits of the hash, H2 takes the top seven for the control byte.
+// A full bucket's control byte never has its high bit set, which is what tells it apart from empty and deleted ones.
+#define H2(hash) ((uint8_t)((hash) >> 25))
+#define IS_FULL(control) (((control) & 0x80) == 0)
+
+// A GroupMask has one bit per bucket of a group that matched, lowest bucket first.
+// SSE2 produces one bit per bucket directly; the NEON version spreads each bucket over four bits,
+// so MASK_SHIFT converts a bit position back into a bucket index.
+typedef uint64_t GroupMask;
+
+#if defined(SWISS_SSE2)
+
+#define MASK_SHIFT 0
+
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+}
+
+// Empty and deleted buckets are the ones whose control byte has the high bit set,
+// which is exactly the bit movemask collects.
+static inline GroupMask matchFree(const uint8_t* group) {
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#elif defined(SWISS_NEON)
+
+#define MASK_SHIFT 2
+
+// Narrows 16 all-ones-or-zero lanes into a 64-bit word with four bits per bucket,
+// keeping only one of the four so that clearing the lowest set bit moves to the next bucket.
+static inline GroupMask neonMask(uint8x16_t lanes) {
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(lanes), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) &
+           0x8888888888888888ull;
+}
+
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    return neonMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)));
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+    return neonMask(vcgeq_u8(vld1q_u8(group), vdupq_n_u8(0x80)));
+}
+
+#else
+
+#define MASK_SHIFT 0
+
+// Portable fallback, one byte at a time.
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] == byte) mask |= (GroupMask)1 << i;
+    }
+    return mask;
+}
+
+static inline GroupMask matchFree(const uint8_t* group) {
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (!IS_FULL(group[i])) mask |= (GroupMask)1 << i;
+    }
+    return mask;
+}
+
+#endif
+
+static inline GroupMask matchEmpty(const uint8_t* group) {
+    return matchByte(group, CONTROL_EMPTY);
+}
+
+// The index within the group of the lowest bucket in a non-zero mask.
+static inline int lowestBucket(GroupMask mask) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask) >> MASK_SHIFT;
+#else
+    int bit = 0;
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit >> MASK_SHIFT;
+#endif
+}
+
+void initTable(Table* table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+    table->resizes = 0;
+    table->stringLookups = 0;
+    table->stringHits = 0;
+    table->control = NULL;
+    table->tombstones = 0;
+}
+
+void freeTable(Table* table) {
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
+    initTable(table);
+}
+
+// Returns the bucket holding key, or -1.
+// Like in table.c, keys are compared by pointer since all strings are interned.
+static int findBucket(uint8_t* control, Entry* entries, int capacity,
+                      ObjString* key) {
+    uint32_t groupMask = (uint32_t)(capacity / GROUP_WIDTH) - 1;
+    uint32_t group = key->hash & groupMask;
+    uint8_t h2 = H2(key->hash);
+
+    for (uint32_t step = 1;; step++) {
+        uint8_t* groupControl = &control[group * GROUP_WIDTH];
+
+        for (GroupMask match = matchByte(groupControl, h2); match != 0;
+             match &= match - 1) {
+            int bucket = (int)(group * GROUP_WIDTH) + lowestBucket(match);
+            if (entries[bucket].key == key) return bucket;
+        }
+
+        if (matchEmpty(groupControl) != 0) return -1;
+        group = (group + step) & groupMask;
+    }
+}
+
+// Returns the first empty or deleted bucket on the probe sequence for hash, which is where an insert goes.
+static int findFreeBucket(uint8_t* control, int capacity, uint32_t hash) {
+    uint32_t groupMask = (uint32_t)(capacity / GROUP_WIDTH) - 1;
+    uint32_t group = hash & groupMask;
+
+    for (uint32_t step = 1;; step++) {
+        GroupMask available = matchFree(&control[group * GROUP_WIDTH]);
+        if (available != 0) return (int)(group * GROUP_WIDTH) + lowestBucket(available);
+        group = (group + step) & groupMask;
+    }
+}
+
+bool tableGet(Table* table, ObjString* key, Value* value) {
+    if (table->count == 0) return false;
+
+    int bucket = findBucket(table->control, table->entries, table->capacity, key);
+    if (bucket < 0) return false;
+
+    *value = table->entries[bucket].value;
+    return true;
+}
+
+int tableFindSlot(Table* table, ObjString* key) {
+    if (table->count == 0) return -1;
+    return findBucket(table->control, table->entries, table->capacity, key);
+}
+
+static void adjustCapacity(Table* table, int capacity) {
+    uint8_t* control = ALLOCATE(uint8_t, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+    Entry* entries = ALLOCATE(Entry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].key = NULL;
+        entries[i].value = NIL_VAL;
+    }
+
+    // Rebuilding drops the deleted buckets.
+    table->count = 0;
+    table->tombstones = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (!IS_FULL(table->control[i])) continue;
+
+        Entry* entry = &table->entries[i];
+        int bucket = findFreeBucket(control, capacity, entry->key->hash);
+        control[bucket] = table->control[i];
+        entries[bucket] = *entry;
+        table->count++;
+    }
+
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
+    table->entries = entries;
+    table->control = control;
+    table->capacity = capacity;
+    table->resizes++;
+}
+
+bool tableSet(Table* table, ObjString* key, Value value) {
+    if (table->count > 0) {
+        int bucket = findBucket(table->control, table->entries, table->capacity, key);
+        if (bucket >= 0) {
+            table->entries[bucket].value = value;
+            return false;
+        }
+    }
+
+    // Tombstones count against the load limit too, since they lengthen probes just like keys.
+    // If it's mostly tombstones that pushed the table over, rebuilding at the same size clears them;
+    // otherwise it doubles. A whole group is the smallest table that SIMD probing can work on.
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        int capacity;
+        if (table->capacity < GROUP_WIDTH) {
+            capacity = GROUP_WIDTH;
+        } else if (table->count + 1 <= table->capacity * TABLE_MAX_LOAD / 2) {
+            capacity = table->capacity;
+        } else {
+            capacity = table->capacity * 2;
+        }
+        adjustCapacity(table, capacity);
+    }
+
+    int bucket = findFreeBucket(table->control, table->capacity, key->hash);
+    if (table->control[bucket] == CONTROL_DELETED) table->tombstones--;
+    table->count++;
+
+    table->control[bucket] = H2(key->hash);
+    table->entries[bucket].key = key;
+    table->entries[bucket].value = value;
+    return true;
+}
+
+static void removeBucket(Table* table, int bucket) {
+    // A probe only moves past a group if the group has no empty bucket.
+    // So if this group still has one, no probe sequence has ever continued past it,
+    // and the bucket can go straight back to empty instead of becoming a tombstone.
+    // (An empty bucket is never re-created in a group that lost all of them, so "still" really holds.)
+    // It's only in full groups that a tombstone is needed to keep later keys reachable.
+    uint8_t* groupControl = &table->control[bucket - bucket % GROUP_WIDTH];
+    if (matchEmpty(groupControl) != 0) {
+        table->control[bucket] = CONTROL_EMPTY;
+    } else {
+        table->control[bucket] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+    // The entry is cleared either way, so that walking entries skips it.
+    table->entries[bucket].key = NULL;
+    table->entries[bucket].value = NIL_VAL;
+    table->count--;
+}
+
+// A table that has emptied out gives its memory back, halving until it's at least a quarter full.
+static void shrinkToFit(Table* table) {
+    int capacity = table->capacity;
+    while (capacity > GROUP_WIDTH && table->count < capacity * TABLE_MIN_LOAD) {
+        capacity /= 2;
+    }
+    if (capacity != table->capacity) adjustCapacity(table, capacity);
+}
+
+bool tableDelete(Table* table, ObjString* key) {
+    if (table->count == 0) return false;
+
+    int bucket = findBucket(table->control, table->entries, table->capacity, key);
+    if (bucket < 0) return false;
+
+    removeBucket(table, bucket);
+    shrinkToFit(table);
+    return true;
+}
+
+void tableAddAll(Table* from, Table* to) {
+    for (int i = 0; i < from->capacity; i++) {
+        Entry* entry = &from->entries[i];
+        if (entry->key != NULL) {
+            tableSet(to, entry->key, entry->value);
+        }
+    }
+}
+
+ObjString* tableFindString(Table* table, const char* chars,
+                           int length, uint32_t hash) {
+    table->stringLookups++;
+    if (table->count == 0) return NULL;
+
+    uint32_t groupMask = (uint32_t)(table->capacity / GROUP_WIDTH) - 1;
+    uint32_t group = hash & groupMask;
+    uint8_t h2 = H2(hash);
+
+    for (uint32_t step = 1;; step++) {
+        uint8_t* groupControl = &table->control[group * GROUP_WIDTH];
+
+        for (GroupMask match = matchByte(groupControl, h2); match != 0;
+             match &= match - 1) {
+            ObjString* key =
+                table->entries[group * GROUP_WIDTH + lowestBucket(match)].key;
+            if (key->length == length && key->hash == hash &&
+                memcmp(key->chars, chars, length) == 0) {
+                table->stringHits++;
+                return key;
+            }
+        }
+
+        if (matchEmpty(groupControl) != 0) return NULL;
+        group = (group + step) & groupMask;
+    }
+}
+
+void tableGetStats(Table* table, TableStats* stats) {
+    stats->count = table->count;
+    stats->capacity = table->capacity;
+    stats->displaced = 0;
+    stats->maxProbe = 0;
+    stats->meanProbe = 0;
+    stats->tombstones = table->tombstones;
+    stats->resizes = table->resizes;
+    stats->stringLookups = table->stringLookups;
+    stats->stringHits = table->stringHits;
+
+    uint32_t groupMask = (uint32_t)(table->capacity / GROUP_WIDTH) - 1;
+    long total = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (!IS_FULL(table->control[i])) continue;
+
+        // Walk the key's probe sequence until it reaches the group the key is in.
+        uint32_t target = (uint32_t)i / GROUP_WIDTH;
+        uint32_t group = table->entries[i].key->hash & groupMask;
+        int probe = 1;
+        for (uint32_t step = 1; group != target; step++) {
+            group = (group + step) & groupMask;
+            probe++;
+        }
+
+        if (probe > 1) stats->displaced++;
+        if (probe > stats->maxProbe) stats->maxProbe = probe;
+        total += probe;
+    }
+    if (table->count > 0) stats->meanProbe = (double)total / table->count;
+}
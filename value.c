@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "object.h"
+#include "output.h"
 #include "memory.h"
 #include "value.h"
 
@@ -8,14 +9,15 @@ void initValueArray(ValueArray* array) {
     array->values = NULL;
     array->capacity = 0;
     array->count = 0;
+    array->arena = NULL;
 }
 
 void writeValueArray(ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values,
-                                   oldCapacity, array->capacity);
+        array->values = ARENA_GROW_ARRAY(array->arena, Value, array->values,
+                                         oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
@@ -23,22 +25,59 @@ void writeValueArray(ValueArray* array, Value value) {
 }
 
 void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+    Arena* arena = array->arena;
+    ARENA_FREE_ARRAY(arena, Value, array->values, array->capacity);
     initValueArray(array);
+    array->arena = arena;
 }
 
+static void printBool(bool boolean) {
+    if (boolean) {
+        writeOutput("true", 4);
+    } else {
+        writeOutput("false", 5);
+    }
+}
+
+static void printNumber(double number) {
+    char buffer[NUMBER_BUFFER_SIZE];
+    writeOutput(buffer, (size_t)formatNumber(number, buffer));
+}
+
+// Writes value to the VM's output buffer, which is flushed at the end of each interpret().
 void printValue(Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printBool(AS_BOOL(value));
+    } else if (IS_NIL(value)) {
+        writeOutput("nil", 3);
+    } else if (IS_NUMBER(value)) {
+        printNumber(AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    }
+#else
     switch (value.type) {
         case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            printBool(AS_BOOL(value));
             break;
-        case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_NIL: writeOutput("nil", 3); break;
+        case VAL_NUMBER: printNumber(AS_NUMBER(value)); break;
         case VAL_OBJ: printObject(value); break;
     }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+    // Numbers go through the double comparison so that NaN != NaN, as IEEE 754 demands.
+    // Everything else is equal exactly when the bits are, since strings are interned.
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (IS_OBJ(a) && IS_OBJ(b)) return objectsEqual(AS_OBJ(a), AS_OBJ(b));
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
@@ -48,7 +87,8 @@ bool valuesEqual(Value a, Value b) {
         // we’ve interned all the strings, we can take advantage of it in the bytecode interpreter.
         // When a user does == on two objects that happen to be strings,
         // we don’t need to test the characters
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:    return objectsEqual(AS_OBJ(a), AS_OBJ(b));
         default:         return false; // Unreachable.
     }
+#endif
 }
\ No newline at end of file
@@ -5,6 +5,67 @@
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
+typedef struct Arena Arena;
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// NaN boxing packs every value into the 64 bits of a double.
+// A double whose exponent bits are all set and whose quiet bit is set is a quiet NaN,
+// and arithmetic only ever produces the one canonical quiet NaN,
+// so the remaining mantissa bits of a quiet NaN are free to hold something else:
+// - a singleton (nil, true, false) in the lowest two bits, or
+// - with the sign bit also set, a 48-bit Obj pointer.
+// Anything that isn't one of those patterns is an ordinary number.
+// That halves the size of every stack slot, constant and table entry compared to the tagged union.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE  3 // 11.
+
+typedef uint64_t Value;
+
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+// Any time we call one of the AS_ macros, we need to guard it behind a call to one of these first
+// (true and false differ only in the lowest bit, so OR-ing it in maps both onto TRUE_VAL)
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) \
+    (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+// Convert a clox Value to C Value
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value) \
+    ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+// Convert a native C value to a clox Value
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj) \
+    (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// memcpy is the one type pun the C standard blesses; compilers turn it into a plain register move.
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
 
 typedef enum {
     VAL_BOOL,
@@ -40,10 +101,13 @@ typedef struct {
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
+
 typedef struct {
     int capacity;
     int count;
     Value* values;
+    Arena* arena; // where values is allocated, or NULL for the heap
 } ValueArray;
 
 bool valuesEqual(Value a, Value b);
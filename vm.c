@@ -1,6 +1,8 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include "cache.h"
 #include "common.h"
 #include "compiler.h"
 #include "vm.h"
@@ -8,216 +10,897 @@
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "registers.h"
 
+_Static_assert(FRAME_SIZE <= STACK_MAX, "the register frame is the stack");
 
-VM vm;
+// Labels-as-values is a GCC/Clang extension, so fall back to the switch anywhere else.
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
+THREAD_LOCAL VM* vm = NULL;
+
+static VM mainVM;
 
 static void resetStack() {
     // set stackTop to point to the beginning of the array to indicate that the stack is empty
-    vm.stackTop = vm.stack;
+    vm->stackTop = vm->stack;
 }
 
 static void runtimeError(const char* format, ...) {
+    flushOutput();
+    flushDebugOutput();
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
+    size_t instruction = vm->ip - vm->chunk->code - 1;
+    int line = getLine(vm->chunk, (int)instruction);
     fprintf(stderr, "[line %d] in script\n", line);
     resetStack();
 }
 
-void initVM() {
+void vmInit(VM* instance) {
+    vm = instance;
     resetStack();
-    vm.objects = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    vm->objects = NULL;
+    vm->chunk = NULL;
+    initHeap(&vm->heap);
+    initArena(&vm->arena);
+    initOutput(&vm->output);
+
+    vm->bytesAllocated = 0;
+    vm->totalAllocated = 0;
+    vm->totalFreed = 0;
+    memset(vm->liveObjects, 0, sizeof(vm->liveObjects));
+#ifdef DEBUG_STRESS_GC
+    vm->nextGC = 0;
+#else
+    vm->nextGC = GC_INITIAL_THRESHOLD;
+#endif
+    vm->traceExecution = false;
+    vm->printCode = false;
+    vm->printStats = false;
+    vm->codeFormat = FORMAT_STACK;
+#ifdef PROFILE_OPCODES
+    vm->profile = NULL;
+#endif
+
+    vm->gcGrowthFactor = GC_HEAP_GROW_FACTOR;
+    vm->gcPhase = GC_IDLE;
+    vm->markSense = true;
+    vm->gcMinor = false;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+
+    vm->youngObjects = NULL;
+    vm->youngBytes = 0;
+#ifdef DEBUG_STRESS_GC
+    vm->nurserySize = 0;
+#else
+    vm->nurserySize = GC_NURSERY_SIZE;
+#endif
+    vm->rememberedCount = 0;
+    vm->rememberedCapacity = 0;
+    vm->remembered = NULL;
+    vm->unswept = NULL;
+    memset(&vm->gcStats, 0, sizeof(vm->gcStats));
+
+    initTable(&vm->globals);
+    initTable(&vm->strings);
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
+void vmFree(VM* instance) {
+    VM* current = vm;
+    vm = instance;
+    flushOutput();
+    freeTable(&vm->globals);
+    freeTable(&vm->strings);
     freeObjects();
+    freeArena(&vm->arena);
+    free(vm->grayStack);
+    vm->grayStack = NULL;
+    vm->grayCapacity = 0;
+    free(vm->remembered);
+    vm->remembered = NULL;
+    vm->rememberedCapacity = 0;
+    vm = current == instance ? NULL : current;
 }
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+void initVM() {
+    vmInit(&mainVM);
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+// Forgets every global, so that another script can run on this VM as if it were new.
+// The interned strings stay, and the collector frees whatever the globals held onto.
+void resetGlobals() {
+    freeTable(&vm->globals);
+    initTable(&vm->globals);
+}
+
+void freeVM() {
+    vmFree(vm);
 }
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+void push(Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
+}
+
+Value pop() {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// The operands stay on the stack until the result exists,
+// since allocating it can set off a collection, and the collector has to be able to see them.
 static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
-
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Obj* b = AS_OBJ(vm->stackTop[-1]);
+    Obj* a = AS_OBJ(vm->stackTop[-2]);
 
-    ObjString* result = takeString(chars, length);
+    Obj* result = concatenateObjects(a, b);
+    vm->stackTop -= 2;
     push(OBJ_VAL(result));
 }
 
 
+// Finds the entry of a global variable through the inline cache of the instruction that names it.
+// The cached bucket is trusted only while it still holds the same key.
+// That check is also the invalidation path: when adjustCapacity() rehashes vm->globals,
+// or a deletion removes the global or shifts it back, the key is no longer in that bucket,
+// and the miss refills the cache from an ordinary probe.
+// Returns NULL if the global isn't defined.
+static inline Entry* findGlobal(int* slot, ObjString* name) {
+    int cached = *slot;
+    if (cached >= 0 && cached < vm->globals.capacity &&
+        vm->globals.entries[cached].key == name) {
+        return &vm->globals.entries[cached];
+    }
+
+    *slot = tableFindSlot(&vm->globals, name);
+    return *slot < 0 ? NULL : &vm->globals.entries[*slot];
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution() {
+    debugWrite("          ", 10);
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        debugWrite("[ ", 2);
+        debugPrintValue(*slot);
+        debugWrite(" ]", 2);
+    }
+    debugWrite("\n", 1);
+    disassembleInstruction(vm->chunk,
+                           (int)(vm->ip - vm->chunk->code));
+}
+#endif
+
 static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+    // The instruction pointer, the stack top and the constant table are read by nearly every instruction,
+    // so run() works on local copies the C compiler can keep in registers instead of going through
+    // the global vm on every READ_BYTE(), push() and pop().
+    // The copies are written back with SAVE_STATE() before calling anything that looks at vm->ip or vm->stackTop,
+    // like runtimeError() or concatenate(), and LOAD_STATE() picks up whatever that call left behind.
+    uint8_t* ip = vm->ip;
+    Value* stackTop = vm->stackTop;
+    Value* constants = vm->chunk->constants.values;
+    int* globalSlots = vm->chunk->globalSlots;
+    int index; // the constant operand, for the handlers that have a long form
+
+#define SAVE_STATE() do { vm->ip = ip; vm->stackTop = stackTop; } while (false)
+#define LOAD_STATE() do { ip = vm->ip; stackTop = vm->stackTop; } while (false)
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+// Reads the operand of a global variable instruction and finds the global's entry through its inline cache.
+#define READ_GLOBAL(name, entry) GLOBAL_AT(READ_BYTE(), name, entry)
+#define GLOBAL_AT(index, name, entry) \
+   do { \
+     int slot = (index); \
+     name = AS_STRING(constants[slot]); \
+     entry = findGlobal(&globalSlots[slot], name); \
+   } while (false)
+// The three-byte operand of the long instructions.
+#define READ_LONG_INDEX() (ip += 3, ip[-3] | (ip[-2] << 8) | (ip[-1] << 16))
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define RUNTIME_ERROR(...) \
+   do { \
+     SAVE_STATE(); \
+     runtimeError(__VA_ARGS__); \
+     return INTERPRET_RUNTIME_ERROR; \
+   } while (false)
 #define BINARY_OP(valueType, op) \
    do { \
-     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-       runtimeError("Operands must be numbers."); \
-       return INTERPRET_RUNTIME_ERROR; \
+     if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+       RUNTIME_ERROR("Operands must be numbers."); \
+     } \
+     double b = AS_NUMBER(POP()); \
+     double a = AS_NUMBER(POP()); \
+     PUSH(valueType(a op b)); \
+        } while (false)
+// The fused forms of BINARY_OP, whose right operand comes from the constant table instead of the stack.
+#define BINARY_OP_CONSTANT(valueType, op) \
+   do { \
+     Value b = READ_CONSTANT(); \
+     if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(b)) { \
+       RUNTIME_ERROR("Operands must be numbers."); \
      } \
-     double b = AS_NUMBER(pop()); \
-     double a = AS_NUMBER(pop()); \
-     push(valueType(a op b)); \
+     PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op AS_NUMBER(b)); \
         } while (false)
     // Using a do while loop in the macro looks funny,
     // but it gives you a way to contain multiple statements inside a block that also permits a semicolon at the end.
 
+    // A build without DEBUG_TRACE_EXECUTION has no trace to skip, not even a test of the flag.
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() \
+    (vm->traceExecution ? (vm->ip = ip, vm->stackTop = stackTop, traceExecution()) : (void)0)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif
 
-    for (;;) {
+    // Likewise the profiler, which a build without PROFILE_OPCODES doesn't have at all.
+#ifdef PROFILE_OPCODES
+    Profile* profile = vm->profile;
+    if (profile != NULL) profileStart(profile);
+#define PROFILE_INSTRUCTION() (profile != NULL ? profileInstruction(profile, vm->chunk, ip) : (void)0)
+#else
+#define PROFILE_INSTRUCTION() ((void)0)
+#endif
 
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk,
-                               (int)(vm.ip - vm.chunk->code));
+    // Each handler ends with DISPATCH() instead of break.
+    // With the switch, that jumps back to the single indirect branch at the top of the loop,
+    // which every opcode shares, so the branch predictor has almost nothing to go on.
+    // With COMPUTED_GOTO, every handler ends with its own `goto *dispatchTable[...]`,
+    // so the predictor can learn which opcode tends to follow which.
+#ifdef COMPUTED_GOTO
+    // An opcode with a handler but no entry here gets a -Wunused-label warning,
+    // and an entry with no handler fails to compile.
+    static void* dispatchTable[] = {
+        [OP_NEGATE]        = &&op_OP_NEGATE,
+        [OP_PRINT]         = &&op_OP_PRINT,
+        [OP_CONSTANT]      = &&op_OP_CONSTANT,
+        [OP_NIL]           = &&op_OP_NIL,
+        [OP_TRUE]          = &&op_OP_TRUE,
+        [OP_FALSE]         = &&op_OP_FALSE,
+        [OP_POP]           = &&op_OP_POP,
+        [OP_GET_GLOBAL]    = &&op_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL]    = &&op_OP_SET_GLOBAL,
+        [OP_EQUAL]         = &&op_OP_EQUAL,
+        [OP_GREATER]       = &&op_OP_GREATER,
+        [OP_LESS]          = &&op_OP_LESS,
+        [OP_ADD]           = &&op_OP_ADD,
+        [OP_SUBTRACT]      = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY]      = &&op_OP_MULTIPLY,
+        [OP_DIVIDE]        = &&op_OP_DIVIDE,
+        [OP_NOT]           = &&op_OP_NOT,
+        [OP_RETURN]        = &&op_OP_RETURN,
+        [OP_ADD_CONSTANT]      = &&op_OP_ADD_CONSTANT,
+        [OP_SUBTRACT_CONSTANT] = &&op_OP_SUBTRACT_CONSTANT,
+        [OP_LESS_CONSTANT]     = &&op_OP_LESS_CONSTANT,
+        [OP_GREATER_CONSTANT]  = &&op_OP_GREATER_CONSTANT,
+        [OP_GET_GLOBAL_ADD]    = &&op_OP_GET_GLOBAL_ADD,
+        [OP_CONSTANT_LONG]      = &&op_OP_CONSTANT_LONG,
+        [OP_GET_GLOBAL_LONG]    = &&op_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG] = &&op_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG]    = &&op_OP_SET_GLOBAL_LONG,
+    };
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name)     op_##name
+#define DISPATCH()     goto *dispatchTable[(TRACE_EXECUTION(), PROFILE_INSTRUCTION(), READ_BYTE())]
+#else
+#define INTERPRET_LOOP for (;;) switch ((TRACE_EXECUTION(), PROFILE_INSTRUCTION(), READ_BYTE()))
+#define CASE(name)     case name
+#define DISPATCH()     continue
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError(
-                        "Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT(); // get the name of the variable from the constant table
-                push(constant);
-                printValue(constant);
-                printf("\n");
-                break;
+
+    INTERPRET_LOOP {
+        CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_ADD):
+        add: {
+            if (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1))) {
+                SAVE_STATE();
+                concatenate();
+                LOAD_STATE();
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            } else {
+                RUNTIME_ERROR(
+                    "Operands must be two numbers or two strings.");
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_NOT):
+            // Unary operators rewrite the top slot in place.
+            // PUSH(f(POP())) would modify stackTop twice without a sequence point.
+            PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        // Each long form reads its wider operand and then shares the short form's handler,
+        // which the short form gets to by falling through, so it doesn't pay for the long one.
+        CASE(OP_CONSTANT_LONG): index = READ_LONG_INDEX(); goto constant;
+        CASE(OP_CONSTANT):
+            index = READ_BYTE();
+        constant: {
+            Value constant = constants[index]; // get the name of the variable from the constant table
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): stackTop--; DISPATCH();
+        CASE(OP_GET_GLOBAL_LONG): index = READ_LONG_INDEX(); goto getGlobal;
+        CASE(OP_GET_GLOBAL):
+            index = READ_BYTE();
+        getGlobal: {
+            ObjString* name;
+            Entry* entry;
+            GLOBAL_AT(index, name, entry);
+            if (entry == NULL) {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            PUSH(entry->value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL_LONG): index = READ_LONG_INDEX(); goto defineGlobal;
+        CASE(OP_DEFINE_GLOBAL):
+            index = READ_BYTE();
+        defineGlobal: {
+            // The globals are old as far as the collector is concerned (a minor collection doesn't scan them),
+            // so storing into them goes through the write barrier. The key is stored too.
+            ObjString* name = AS_STRING(constants[index]);
+            writeBarrier(OBJ_VAL(name));
+            writeBarrier(PEEK(0));
+            tableSet(&vm->globals, name, PEEK(0));
+            stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_LONG): index = READ_LONG_INDEX(); goto setGlobal;
+        CASE(OP_SET_GLOBAL):
+            index = READ_BYTE();
+        setGlobal: {
+            // Assignment never creates a global, so a cache hit can store straight into the entry.
+            ObjString* name;
+            Entry* entry;
+            GLOBAL_AT(index, name, entry);
+            if (entry == NULL) {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            writeBarrier(PEEK(0));
+            entry->value = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            // Comparing a rope flattens it, which allocates,
+            // so like concatenate() this leaves the operands on the stack until it's done.
+            SAVE_STATE();
+            bool equal = valuesEqual(PEEK(1), PEEK(0));
+            stackTop--;
+            PEEK(0) = BOOL_VAL(equal);
+            DISPATCH();
+        }
+        CASE(OP_PRINT): {
+            // When the interpreter reaches this instruction, it has already executed the code for the expression,
+            // leaving the result value on top of the stack. Now we simply print it and pop it,
+            // in that order because printing a rope flattens it.
+            SAVE_STATE();
+            printValue(PEEK(0));
+            endOutputLine();
+            stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_ADD_CONSTANT): {
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(b)) {
+                PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(b));
+                DISPATCH();
             }
-            case OP_PRINT: {
-                // When the interpreter reaches this instruction, it has already executed the code for the expression,
-                // leaving the result value on top of the stack. Now we simply pop and print it.
-                printValue(pop());
-                printf("\n");
-                break;
+            // Strings and type errors are rare enough to take the unfused path,
+            // with the right operand pushed where OP_ADD expects it.
+            PUSH(b);
+            goto add;
+        }
+        CASE(OP_SUBTRACT_CONSTANT): BINARY_OP_CONSTANT(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_LESS_CONSTANT):     BINARY_OP_CONSTANT(BOOL_VAL, <); DISPATCH();
+        CASE(OP_GREATER_CONSTANT):  BINARY_OP_CONSTANT(BOOL_VAL, >); DISPATCH();
+        CASE(OP_GET_GLOBAL_ADD): {
+            ObjString* name;
+            Entry* entry;
+            READ_GLOBAL(name, entry);
+            if (entry == NULL) {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
             }
-            case OP_RETURN: {
-                // Exit interpreter.
-                return INTERPRET_OK;
+            Value b = entry->value;
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(b)) {
+                PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + AS_NUMBER(b));
+                DISPATCH();
             }
+            PUSH(b);
+            goto add;
+        }
+        CASE(OP_RETURN): {
+            // Exit interpreter.
+            SAVE_STATE();
+            return INTERPRET_OK;
         }
     }
 
+    return INTERPRET_RUNTIME_ERROR; // Unreachable: every handler dispatches or returns.
+
+#undef SAVE_STATE
+#undef LOAD_STATE
 #undef READ_BYTE
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_GLOBAL
+#undef GLOBAL_AT
+#undef READ_LONG_INDEX
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef RUNTIME_ERROR
+#undef BINARY_OP
+#undef BINARY_OP_CONSTANT
+#undef TRACE_EXECUTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+
+
+// run() for a chunk in FORMAT_REGISTER; see registers.h.
+// The frame is vm->stack, and the registers are the part of it below vm->stackTop,
+// so the collector sees them as it would the stack. They start out nil, since nothing has been put in them yet,
+// and whatever an earlier chunk left there may have been freed since.
+// The literals and constants copied in above them aren't roots: the chunk's constants are.
+static InterpretResult runRegisters() {
+    Chunk* chunk = vm->chunk;
+    uint8_t* ip = vm->ip;
+    Value* frame = vm->stack;
+    Value* constants = chunk->constants.values;
+    int* globalSlots = chunk->globalSlots;
+    uint8_t* operand; // the operands of the instruction being run
+    int index;        // the constant operand, for the handlers that have a long form
+    uint8_t slot;     // and the slot operand in front of it
+    Value a;
+    Value b;
+
+    for (int i = 0; i < chunk->registerCount; i++) frame[i] = NIL_VAL;
+    vm->stackTop = frame + chunk->registerCount;
+    frame[FRAME_NIL] = NIL_VAL;
+    frame[FRAME_TRUE] = BOOL_VAL(true);
+    frame[FRAME_FALSE] = BOOL_VAL(false);
+    int copied = chunk->constants.count < FRAME_CONSTANT_COUNT ? chunk->constants.count : FRAME_CONSTANT_COUNT;
+    if (copied > 0) memcpy(&frame[FRAME_CONSTANTS], constants, sizeof(Value) * copied);
+
+#define READ_BYTE() (*ip++)
+#define READ_LONG_INDEX() (ip += 3, ip[-3] | (ip[-2] << 8) | (ip[-1] << 16))
+// Steps over the operands of an instruction, leaving operand pointing at the first of them.
+#define READ_OPERANDS(count) (operand = ip, ip += (count))
+#define GLOBAL_AT(index, name, entry) \
+   do { \
+     int global = (index); \
+     name = AS_STRING(constants[global]); \
+     entry = findGlobal(&globalSlots[global], name); \
+   } while (false)
+#define RUNTIME_ERROR(...) \
+   do { \
+     vm->ip = ip; \
+     runtimeError(__VA_ARGS__); \
+     return INTERPRET_RUNTIME_ERROR; \
+   } while (false)
+#define BINARY_OP(valueType, op) \
+   do { \
+     READ_OPERANDS(3); \
+     a = frame[operand[1]]; \
+     b = frame[operand[2]]; \
+     if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+       RUNTIME_ERROR("Operands must be numbers."); \
+     } \
+     frame[operand[0]] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+   } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() (vm->traceExecution ? (vm->ip = ip, traceExecution()) : (void)0)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif
+
+#ifdef PROFILE_OPCODES
+    Profile* profile = vm->profile;
+    if (profile != NULL) profileStart(profile);
+#define PROFILE_INSTRUCTION() (profile != NULL ? profileInstruction(profile, chunk, ip) : (void)0)
+#else
+#define PROFILE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[OP_COUNT] = {
+        [OP_REG_LOAD_CONSTANT]      = &&op_OP_REG_LOAD_CONSTANT,
+        [OP_REG_LOAD_CONSTANT_LONG] = &&op_OP_REG_LOAD_CONSTANT_LONG,
+        [OP_REG_GET_GLOBAL]         = &&op_OP_REG_GET_GLOBAL,
+        [OP_REG_GET_GLOBAL_LONG]    = &&op_OP_REG_GET_GLOBAL_LONG,
+        [OP_REG_DEFINE_GLOBAL]      = &&op_OP_REG_DEFINE_GLOBAL,
+        [OP_REG_DEFINE_GLOBAL_LONG] = &&op_OP_REG_DEFINE_GLOBAL_LONG,
+        [OP_REG_SET_GLOBAL]         = &&op_OP_REG_SET_GLOBAL,
+        [OP_REG_SET_GLOBAL_LONG]    = &&op_OP_REG_SET_GLOBAL_LONG,
+        [OP_REG_EQUAL]              = &&op_OP_REG_EQUAL,
+        [OP_REG_GREATER]            = &&op_OP_REG_GREATER,
+        [OP_REG_LESS]               = &&op_OP_REG_LESS,
+        [OP_REG_ADD]                = &&op_OP_REG_ADD,
+        [OP_REG_SUBTRACT]           = &&op_OP_REG_SUBTRACT,
+        [OP_REG_MULTIPLY]           = &&op_OP_REG_MULTIPLY,
+        [OP_REG_DIVIDE]             = &&op_OP_REG_DIVIDE,
+        [OP_REG_ADD_GLOBAL]         = &&op_OP_REG_ADD_GLOBAL,
+        [OP_REG_NOT]                = &&op_OP_REG_NOT,
+        [OP_REG_NEGATE]             = &&op_OP_REG_NEGATE,
+        [OP_REG_PRINT]              = &&op_OP_REG_PRINT,
+        [OP_REG_RETURN]             = &&op_OP_REG_RETURN,
+    };
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(name)     op_##name
+#define DISPATCH()     goto *dispatchTable[(TRACE_EXECUTION(), PROFILE_INSTRUCTION(), READ_BYTE())]
+#else
+#define INTERPRET_LOOP for (;;) switch ((TRACE_EXECUTION(), PROFILE_INSTRUCTION(), READ_BYTE()))
+#define CASE(name)     case name
+#define DISPATCH()     continue
+#endif
+
+    INTERPRET_LOOP {
+        CASE(OP_REG_GREATER):  BINARY_OP(BOOL_VAL, >); DISPATCH();
+        CASE(OP_REG_LESS):     BINARY_OP(BOOL_VAL, <); DISPATCH();
+        CASE(OP_REG_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_REG_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_REG_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_REG_ADD):
+            READ_OPERANDS(3);
+            a = frame[operand[1]];
+            b = frame[operand[2]];
+        add:
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                frame[operand[0]] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+            } else if (IS_TEXT(a) && IS_TEXT(b)) {
+                // The operands are roots, in the frame or the constants or a global, while the result is allocated.
+                frame[operand[0]] = OBJ_VAL(concatenateObjects(AS_OBJ(a), AS_OBJ(b)));
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        CASE(OP_REG_ADD_GLOBAL): {
+            READ_OPERANDS(3);
+            ObjString* name;
+            Entry* entry;
+            GLOBAL_AT(operand[2], name, entry);
+            if (entry == NULL) {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+            }
+            a = frame[operand[1]];
+            b = entry->value;
+            goto add;
+        }
+        CASE(OP_REG_EQUAL): {
+            // Comparing a rope flattens it, which allocates, so the result is only stored once that's done.
+            READ_OPERANDS(3);
+            bool equal = valuesEqual(frame[operand[1]], frame[operand[2]]);
+            frame[operand[0]] = BOOL_VAL(equal);
+            DISPATCH();
+        }
+        CASE(OP_REG_NOT):
+            READ_OPERANDS(2);
+            frame[operand[0]] = BOOL_VAL(isFalsey(frame[operand[1]]));
+            DISPATCH();
+        CASE(OP_REG_NEGATE):
+            READ_OPERANDS(2);
+            a = frame[operand[1]];
+            if (!IS_NUMBER(a)) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            frame[operand[0]] = NUMBER_VAL(-AS_NUMBER(a));
+            DISPATCH();
+        CASE(OP_REG_LOAD_CONSTANT_LONG): slot = READ_BYTE(); index = READ_LONG_INDEX(); goto loadConstant;
+        CASE(OP_REG_LOAD_CONSTANT):
+            slot = READ_BYTE();
+            index = READ_BYTE();
+        loadConstant:
+            frame[slot] = constants[index];
+            DISPATCH();
+        CASE(OP_REG_GET_GLOBAL_LONG): slot = READ_BYTE(); index = READ_LONG_INDEX(); goto getGlobal;
+        CASE(OP_REG_GET_GLOBAL):
+            slot = READ_BYTE();
+            index = READ_BYTE();
+        getGlobal: {
+            ObjString* name;
+            Entry* entry;
+            GLOBAL_AT(index, name, entry);
+            if (entry == NULL) {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+            }
+            frame[slot] = entry->value;
+            DISPATCH();
+        }
+        CASE(OP_REG_DEFINE_GLOBAL_LONG): slot = READ_BYTE(); index = READ_LONG_INDEX(); goto defineGlobal;
+        CASE(OP_REG_DEFINE_GLOBAL):
+            slot = READ_BYTE();
+            index = READ_BYTE();
+        defineGlobal: {
+            ObjString* name = AS_STRING(constants[index]);
+            writeBarrier(OBJ_VAL(name));
+            writeBarrier(frame[slot]);
+            tableSet(&vm->globals, name, frame[slot]);
+            DISPATCH();
+        }
+        CASE(OP_REG_SET_GLOBAL_LONG): slot = READ_BYTE(); index = READ_LONG_INDEX(); goto setGlobal;
+        CASE(OP_REG_SET_GLOBAL):
+            slot = READ_BYTE();
+            index = READ_BYTE();
+        setGlobal: {
+            ObjString* name;
+            Entry* entry;
+            GLOBAL_AT(index, name, entry);
+            if (entry == NULL) {
+                RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+            }
+            writeBarrier(frame[slot]);
+            entry->value = frame[slot];
+            DISPATCH();
+        }
+        CASE(OP_REG_PRINT):
+            printValue(frame[READ_BYTE()]);
+            endOutputLine();
+            DISPATCH();
+        CASE(OP_REG_RETURN):
+            vm->ip = ip;
+            vm->stackTop = vm->stack;
+            return INTERPRET_OK;
+    }
+
+    return INTERPRET_RUNTIME_ERROR; // Unreachable: every handler dispatches or returns.
+
+#undef READ_BYTE
+#undef READ_LONG_INDEX
+#undef READ_OPERANDS
+#undef GLOBAL_AT
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef TRACE_EXECUTION
+#undef PROFILE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+}
+
+static InterpretResult execute(Chunk* chunk) {
+    // we send the completed chunk over to the VM to be executed
+    vm->chunk = chunk;
+    vm->ip = vm->chunk->code;
+
+    InterpretResult result = chunk->format == FORMAT_REGISTER ? runRegisters() : run();
+    flushOutput();
+    flushDebugOutput();
+    vm->chunk = NULL;
+    return result;
 }
 
+static InterpretResult runChunk(Chunk* chunk) {
+    InterpretResult result = execute(chunk);
 
+    // Everything the chunk and the compiler used goes back in one go.
+    // Nothing in the arena outlives the call: constants are objects, and objects live in the heap.
+    freeChunk(chunk);
+    freeArena(&vm->arena);
+    return result;
+}
+
+// Runs a chunk from compile() and leaves it as it is, for the caller to run again or free.
+// The chunk's constants are only roots while it runs, so nothing may allocate in between.
+InterpretResult interpretChunk(Chunk* chunk) {
+    return execute(chunk);
+}
 
 InterpretResult interpret(const char* source) {
     Chunk chunk;
-    initChunk(&chunk);
+    initChunk(&chunk, &vm->arena);
 
     // The compiler will take the user’s program and fill up the chunk with bytecode
     if (!compile(source, &chunk)) {
         freeChunk(&chunk);
+        freeArena(&vm->arena);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    // we send the completed chunk over to the VM to be executed
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    return runChunk(&chunk);
+}
 
-    InterpretResult result = run();
+// interpret() for a script with a bytecode cache at cachePath (see cache.h).
+// A fresh cache is run without scanning or compiling anything; otherwise the script is compiled
+// as usual and the cache written for next time. A chunk that fails to compile is never cached.
+InterpretResult interpretCached(const char* source, size_t length, const char* cachePath) {
+    Chunk chunk;
+    initChunk(&chunk, &vm->arena);
+    uint64_t sourceHash = hashSource(source, length);
+
+    ChunkImage image;
+    if (loadChunk(cachePath, &chunk, &image, sourceHash, length)) {
+        InterpretResult result = runChunk(&chunk);
+        unloadChunk(&image);
+        return result;
+    }
 
     freeChunk(&chunk);
+    if (!compile(source, &chunk)) {
+        freeChunk(&chunk);
+        freeArena(&vm->arena);
+        return INTERPRET_COMPILE_ERROR;
+    }
+    saveChunk(cachePath, &chunk, sourceHash, length);
+    return runChunk(&chunk);
+}
+
+// How much of a streamed script is read at a time, unless a single declaration needs more.
+#ifndef STREAM_PIECE_SIZE
+#define STREAM_PIECE_SIZE (1024 * 1024)
+#endif
+
+// interpret() for a source read a piece at a time, for scripts too big to be held in memory whole.
+// The declarations in each piece are compiled and run before the next piece is read,
+// and then thrown away along with their bytecode, so however long the script is,
+// clox only ever holds one piece of it and that piece's chunk, besides the heap.
+// Since a piece runs as soon as it's compiled, a compile error stops the script part way through,
+// after everything before it has run.
+InterpretResult interpretStream(SourceReader read, void* userData) {
+    size_t capacity = STREAM_PIECE_SIZE;
+    char* piece = (char*)malloc(capacity);
+    if (piece == NULL) exit(1);
+    size_t length = 0;
+    bool final = false;
+    int line = 1;
+
+    InterpretResult result = INTERPRET_OK;
+    for (;;) {
+        while (!final && length < capacity - 1) {
+            size_t count = read(piece + length, capacity - 1 - length, userData);
+            if (count == 0) final = true;
+            length += count;
+        }
+        piece[length] = '\0';
+
+        Chunk chunk;
+        initChunk(&chunk, &vm->arena);
+        size_t consumed;
+        BatchResult batch = compileBatch(piece, length, final, &chunk, &consumed, &line);
+        if (batch == BATCH_ERROR) {
+            freeChunk(&chunk);
+            freeArena(&vm->arena);
+            result = INTERPRET_COMPILE_ERROR;
+            break;
+        }
+        result = runChunk(&chunk);
+        if (result != INTERPRET_OK || batch == BATCH_FINISHED) break;
+
+        // What's left is the start of a declaration that the next piece finishes.
+        // One that doesn't fit in a piece at all makes the pieces bigger.
+        memmove(piece, piece + consumed, length - consumed);
+        length -= consumed;
+        if (consumed == 0) {
+            capacity *= 2;
+            piece = (char*)realloc(piece, capacity);
+            if (piece == NULL) exit(1);
+        }
+    }
+
+    free(piece);
+    return result;
+}
+
+void initSession(Session* session) {
+    initChunk(&session->chunk, NULL);
+}
+
+void freeSession(Session* session) {
+    freeChunk(&session->chunk);
+}
+
+// interpret() for a REPL, where source is a line, or a few, that the session's VM hasn't seen yet,
+// the first of them line number line. Lines come one after another for as long as the REPL runs,
+// so rather than each one getting a chunk of its own in the arena, they all take turns with the session's.
+// Its code, line table and constants are emptied for every line but keep their size,
+// and after the first few lines, compiling one allocates next to nothing.
+// The constants don't carry over from line to line: most of them are numbers and strings that are used once,
+// and a pool they stayed in would only grow.
+InterpretResult interpretSession(Session* session, const char* source, size_t length, int line) {
+    Chunk* chunk = &session->chunk;
+    resetChunk(chunk);
+
+    size_t consumed;
+    if (compileBatch(source, length, true, chunk, &consumed, &line) == BATCH_ERROR) {
+        return INTERPRET_COMPILE_ERROR;
+    }
+    return execute(chunk);
+}
+
+void vmGetStats(VM* instance, VMStats* stats) {
+    VM* current = vm;
+    vm = instance;
+    stats->bytesAllocated = vm->totalAllocated;
+    stats->bytesFreed = vm->totalFreed;
+    stats->objectBytes = vm->bytesAllocated;
+    memcpy(stats->liveObjects, vm->liveObjects, sizeof(stats->liveObjects));
+    getMemoryStats(&stats->memory);
+    getGCStats(&stats->gc);
+    tableGetStats(&vm->strings, &stats->strings);
+    tableGetStats(&vm->globals, &stats->globals);
+    vm = current;
+}
+
+static void printTableStats(const char* name, const TableStats* stats, FILE* out) {
+    fprintf(out, "%-8s %d keys in %d buckets (%.0f%% full), %d resizes, %d tombstones\n",
+            name, stats->count, stats->capacity,
+            stats->capacity == 0 ? 0.0 : 100.0 * stats->count / stats->capacity,
+            stats->resizes, stats->tombstones);
+    fprintf(out, "         probes: mean %.2f, max %d, %d keys displaced\n",
+            stats->meanProbe, stats->maxProbe, stats->displaced);
+}
+
+// What --stats prints.
+void printStats(const VMStats* stats, FILE* out) {
+    fprintf(out, "== stats ==\n");
+    fprintf(out, "memory   %zu bytes allocated, %zu freed, %zu in use\n",
+            stats->bytesAllocated, stats->bytesFreed, stats->bytesAllocated - stats->bytesFreed);
+    fprintf(out, "objects  %zu strings, %zu ropes live, in %zu bytes\n",
+            stats->liveObjects[OBJ_STRING], stats->liveObjects[OBJ_ROPE], stats->objectBytes);
+    for (int i = 0; i < POOL_CLASS_COUNT; i++) {
+        const AllocStats* pool = &stats->memory.pools[i];
+        if (pool->allocations == 0) continue;
+        fprintf(out, "pool %3zu %zu allocations, %zu bytes, %zu blocks\n",
+                stats->memory.poolSizes[i], pool->allocations, pool->bytes, pool->blocks);
+    }
+    fprintf(out, "large    %zu allocations, %zu bytes\n", stats->memory.large.allocations, stats->memory.large.bytes);
+    fprintf(out, "arena    %zu allocations, %zu bytes\n", stats->memory.arena.allocations, stats->memory.arena.bytes);
+    fprintf(out, "gc       %zu minor, %zu major collections, %zu objects promoted\n",
+            stats->gc.minorCollections, stats->gc.majorCollections, stats->gc.promoted);
+    fprintf(out, "         %zu pauses, %.3f ms in all, %.3f ms at most\n",
+            stats->gc.pauseCount, stats->gc.totalPause / 1e6, stats->gc.maxPause / 1e6);
+
+    printTableStats("strings", &stats->strings, out);
+    fprintf(out, "         %zu lookups, %zu hits (%.1f%%)\n", stats->strings.stringLookups, stats->strings.stringHits,
+            stats->strings.stringLookups == 0 ? 0.0 : 100.0 * stats->strings.stringHits / stats->strings.stringLookups);
+    printTableStats("globals", &stats->globals, out);
+}
+
+InterpretResult vmInterpret(VM* instance, const char* source) {
+    VM* current = vm;
+    vm = instance;
+    InterpretResult result = interpret(source);
+    vm = current;
     return result;
-}
\ No newline at end of file
+}
+
+InterpretResult vmInterpretCached(VM* instance, const char* source, size_t length, const char* cachePath) {
+    VM* current = vm;
+    vm = instance;
+    InterpretResult result = interpretCached(source, length, cachePath);
+    vm = current;
+    return result;
+}
@@ -1,7 +1,12 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <stdio.h>
+
 #include "chunk.h"
+#include "memory.h"
+#include "output.h"
+#include "profile.h"
 #include "table.h"
 #include "value.h"
 #define STACK_MAX 256
@@ -28,6 +33,53 @@ typedef struct {
     Table strings;
 
     Obj* objects; //  a pointer to the head of the linked list for gc
+
+    // Where the objects' memory comes from. See memory.c.
+    Heap heap;
+
+    // The collector's state. See the comment above linkObject() in memory.c.
+    size_t bytesAllocated; // the bytes taken by objects that haven't been freed yet
+    size_t nextGC;         // start a major collection, or its next slice, once bytesAllocated goes past this
+    double gcGrowthFactor; // GC_HEAP_GROW_FACTOR unless changed
+    GCPhase gcPhase;
+    bool markSense;        // what isMarked is set to by the current major collection
+    bool gcMinor;          // a minor collection is marking, so old objects are left alone
+    int grayCount;
+    int grayCapacity;
+    Obj** grayStack;       // objects that are marked but whose references haven't been traced yet
+
+    Obj* youngObjects;     // the nursery
+    size_t youngBytes;
+    size_t nurserySize;    // GC_NURSERY_SIZE unless changed
+    int rememberedCount;
+    int rememberedCapacity;
+    Obj** remembered;      // young objects stored somewhere old since the last minor collection
+    Obj* unswept;          // old objects the sweep hasn't got to yet, while gcPhase is GC_SWEEPING
+    GCStats gcStats;
+
+    // Counted for vmGetStats().
+    size_t totalAllocated;                // the bytes reallocate() has handed out, ever
+    size_t totalFreed;                    // and taken back
+    size_t liveObjects[OBJ_TYPE_COUNT];   // linked and not yet freed, by type
+
+    // Set from the command line with --trace and --dump. They only work in builds with
+    // DEBUG_TRACE_EXECUTION and DEBUG_PRINT_CODE, which CMake defines for Debug builds.
+    bool traceExecution; // print the stack and each instruction as it runs
+    bool printCode;      // disassemble each chunk once it's compiled
+    // And with --stats, in any build: clox prints vmGetStats() for the VM when it's done with it.
+    bool printStats;
+    // What compile() emits; --registers makes it FORMAT_REGISTER.
+    CodeFormat codeFormat;
+
+    // Memory that only lives for one call to interpret(): the chunk and the compiler's scratch space.
+    Arena arena;
+
+    // Where print writes to. See output.c.
+    Output output;
+
+#ifdef PROFILE_OPCODES
+    Profile* profile; // what run() counts into, or NULL to not profile; see profile.h
+#endif
 } VM;
 
 
@@ -37,12 +89,66 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
   } InterpretResult;
 
-extern VM vm;
+// The VM the calling thread is working with. Everything from interpret() down to the allocator works on *vm,
+// so separate VMs can run at the same time, one to a thread, without sharing anything.
+// vmInit() makes the instance it's given the thread's current VM. The other vm*() functions work on theirs
+// and leave the thread's current VM as they found it, except that vmFree() of the current VM leaves none.
+// initVM() is vmInit() of a VM of the program's own, for programs that only need one,
+// and freeVM(), interpret() and interpretCached() work on whichever VM is current.
+// A VM can move from one thread to another, but only be used by one of them at a time.
+extern THREAD_LOCAL VM* vm;
+
+// Where interpretStream() gets the source from: it fills buffer with up to size characters
+// and returns how many, or 0 at the end of the source.
+typedef size_t (*SourceReader)(char* buffer, size_t size, void* userData);
+
+// Everything the VM counts about its memory and its tables, for tuning the collector and the load factors.
+typedef struct {
+    size_t bytesAllocated;  // through reallocate(): blocks, arrays and table buckets
+    size_t bytesFreed;
+    size_t objectBytes;     // in live objects, what the collector's thresholds are measured against
+    size_t liveObjects[OBJ_TYPE_COUNT];
+    MemoryStats memory;
+    GCStats gc;
+    TableStats strings;     // the intern table
+    TableStats globals;
+} VMStats;
+
+// A REPL's compilation context, kept from one line to the next. See interpretSession().
+typedef struct {
+    Chunk chunk;
+} Session;
+
+void vmInit(VM* instance);
+void vmFree(VM* instance);
+InterpretResult vmInterpret(VM* instance, const char* source);
+InterpretResult vmInterpretCached(VM* instance, const char* source, size_t length, const char* cachePath);
+void vmGetStats(VM* instance, VMStats* stats);
+void printStats(const VMStats* stats, FILE* out);
 
 void initVM();
 void freeVM();
+void resetGlobals();
 InterpretResult interpret(const char* source);
+InterpretResult interpretChunk(Chunk* chunk);
+InterpretResult interpretCached(const char* source, size_t length, const char* cachePath);
+InterpretResult interpretStream(SourceReader read, void* userData);
+void initSession(Session* session);
+void freeSession(Session* session);
+InterpretResult interpretSession(Session* session, const char* source, size_t length, int line);
 void push(Value value);
+
+// Has to be called whenever a value is stored somewhere the next minor collection won't look
+// (anywhere but the stack, the chunks' constants and other young objects), such as a global.
+// The common case, an old object or one already remembered, is a couple of loads and no call.
+static inline void writeBarrier(Value value) {
+    if (!IS_OBJ(value)) return;
+    Obj* object = AS_OBJ(value);
+    if ((object->isYoung && !object->isRemembered) || vm->gcPhase == GC_MARKING) {
+        writeBarrierSlow(object);
+    }
+}
+
 Value pop();
 
 #endif
\ No newline at end of file